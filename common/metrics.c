@@ -0,0 +1,145 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static struct {
+  struct metrics_segment *segment;
+  char name[64];
+} metrics;
+
+/* The calling thread's ring, NULL until its first record */
+static __thread struct metrics_ring *self;
+static __thread bool no_ring;
+
+bool MetricsOpen(const char *name, const char *tool)
+{
+  struct metrics_segment *segment;
+  int fd;
+
+  snprintf(metrics.name, sizeof(metrics.name), "%s%s",
+           name[0] == '/' ? "" : "/", name);
+  fd = shm_open(metrics.name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("shm_open");
+    return false;
+  }
+  if (ftruncate(fd, sizeof(*segment)) < 0) {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(metrics.name);
+    return false;
+  }
+  segment = mmap(NULL, sizeof(*segment), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    perror("mmap");
+    shm_unlink(metrics.name);
+    return false;
+  }
+
+  // The segment starts zeroed, magic goes last so readers see it complete
+  segment->version = METRICS_VERSION;
+  segment->writers = METRICS_WRITERS;
+  segment->ring_size = METRICS_RING;
+  segment->pid = getpid();
+  snprintf(segment->tool, sizeof(segment->tool), "%s", tool);
+  atomic_thread_fence(memory_order_release);
+  segment->magic = METRICS_MAGIC;
+  metrics.segment = segment;
+  return true;
+}
+
+bool MetricsEnabled(void)
+{
+  return metrics.segment != NULL;
+}
+
+void MetricsAdd(enum metrics_counter counter, uint64_t delta)
+{
+  if (metrics.segment)
+    atomic_fetch_add_explicit(&metrics.segment->counters[counter], delta,
+                              memory_order_relaxed);
+}
+
+static struct metrics_ring *this_ring(void)
+{
+  uint32_t n;
+
+  if (self || no_ring)
+    return self;
+  n = atomic_fetch_add(&metrics.segment->rings_used, 1);
+  if (n >= METRICS_WRITERS) {
+    no_ring = true;
+    return NULL;
+  }
+  self = &metrics.segment->rings[n];
+  atomic_store(&self->tid, (int32_t) syscall(SYS_gettid));
+  return self;
+}
+
+void MetricsPublish(enum metrics_kind kind, const char *name,
+                    const double *values, int count)
+{
+  struct metrics_ring *ring;
+  struct metrics_record *r;
+  struct timespec ts;
+  uint64_t head;
+
+  if (!metrics.segment || !(ring = this_ring()))
+    return;
+  if (count > METRICS_VALUES)
+    count = METRICS_VALUES;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  r = &ring->records[head % METRICS_RING];
+  atomic_store_explicit(&r->seq, 2 * head + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  r->time_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  r->kind = kind;
+  r->count = count;
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  memcpy(r->values, values, count * sizeof(*values));
+  atomic_store_explicit(&r->seq, 2 * head + 2, memory_order_release);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void MetricsClose(void)
+{
+  if (!metrics.segment || atomic_exchange(&metrics.segment->closed, 1))
+    return;
+  // Attached readers keep their mapping, new ones can't find it anymore.
+  // Ours stays too, other threads may still be publishing.
+  shm_unlink(metrics.name);
+}
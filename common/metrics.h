@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Live metrics published into a POSIX shared memory segment, so a monitor
+ * can follow a run without parsing its output. Writing never blocks or
+ * makes a syscall: each publishing thread owns a ring of fixed size
+ * records and readers detect records overwritten while they read them.
+ * Everything is a no-op until MetricsOpen() succeeded.
+ */
+
+#define METRICS_MAGIC 0x4d657472  /* "Metr" */
+#define METRICS_VERSION 1
+/* Threads that can publish records, each gets its own ring */
+#define METRICS_WRITERS 4
+#define METRICS_RING 256
+#define METRICS_VALUES 8
+
+/* Counters updated in place, for scraping the current totals */
+enum metrics_counter {
+  METRIC_FRAMES,
+  METRIC_CHECKS,          /* golden frames or results checked */
+  METRIC_FAILED_CHECKS,
+  METRIC_KERNELS,
+  METRIC_COUNTERS,
+};
+
+/* Record kinds and the meaning of their values */
+enum metrics_kind {
+  /* frames, fps, p50, p90, p99, p99.9, max frame time in ms */
+  METRICS_FRAME_TIMES = 1,
+  /* index, passed (0/1), bad pixels, max channel delta, PSNR dB */
+  METRICS_CHECK,
+  /* device execution ms, queued to start ms */
+  METRICS_KERNEL,
+};
+
+/*
+ * A record is valid when seq is even and the same before and after reading
+ * it. Record n of a ring has seq 2 * n + 2 once written.
+ */
+struct metrics_record {
+  _Atomic uint64_t seq;
+  uint64_t time_ns;       /* CLOCK_MONOTONIC */
+  uint32_t kind;
+  uint32_t count;         /* values used */
+  char name[32];
+  double values[METRICS_VALUES];
+};
+
+struct metrics_ring {
+  _Atomic uint64_t head;  /* records written so far */
+  _Atomic int32_t tid;    /* writing thread, 0 while unclaimed */
+  uint32_t pad;
+  struct metrics_record records[METRICS_RING];
+};
+
+struct metrics_segment {
+  uint32_t magic, version;
+  uint32_t writers, ring_size;
+  int32_t pid;
+  _Atomic uint32_t closed;  /* set when the writer process is done */
+  char tool[32];
+  _Atomic uint64_t counters[METRIC_COUNTERS];
+  _Atomic uint32_t rings_used;
+  struct metrics_ring rings[METRICS_WRITERS];
+};
+
+/*
+ * Create segment name with shm_open(), a leading '/' is added if missing.
+ * The segment is unlinked again by MetricsClose().
+ */
+bool MetricsOpen(const char *name, const char *tool);
+bool MetricsEnabled(void);
+
+void MetricsAdd(enum metrics_counter counter, uint64_t delta);
+
+/*
+ * Append a record to the calling thread's ring. Threads past the first
+ * METRICS_WRITERS publishing ones are ignored.
+ */
+void MetricsPublish(enum metrics_kind kind, const char *name,
+                    const double *values, int count);
+
+/* Mark the segment closed and unlink its name, safe to call twice */
+void MetricsClose(void);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The counters form one perf event group so a single read() returns all
+ * of them, scaled by enabled/running time when the PMU had to multiplex.
+ * Kernel-side counting is tried first, since driver ioctls matter here,
+ * and dropped when perf_event_paranoid does not allow it.
+ */
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "perfcount.h"
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} counters[PERF_COUNTERS] = {
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  { "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+static struct {
+  int leader;
+  int fds[PERF_COUNTERS];
+  /* Position of each counter in the group read, -1 if not opened */
+  int slot[PERF_COUNTERS];
+  int opened;
+} perf = { .leader = -1 };
+
+/* Counters only count the thread that opened them, others don't measure */
+static __thread bool owner;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static int open_counter(int i, bool exclude_kernel)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = counters[i].type;
+  attr.config = counters[i].config;
+  attr.disabled = perf.leader < 0;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, perf.leader, 0);
+}
+
+bool PerfInit(void)
+{
+  bool exclude_kernel = false;
+  int i;
+
+  PerfRelease();
+  for (i = 0; i < PERF_COUNTERS; i++) {
+    int fd = open_counter(i, exclude_kernel);
+    if (fd < 0 && errno == EACCES && !exclude_kernel && perf.leader < 0) {
+      exclude_kernel = true;
+      fd = open_counter(i, exclude_kernel);
+    }
+    perf.slot[i] = -1;
+    perf.fds[i] = fd;
+    if (fd < 0)
+      continue;
+    if (perf.leader < 0)
+      perf.leader = fd;
+    perf.slot[i] = perf.opened++;
+  }
+  if (!perf.opened) {
+    fprintf(stderr, "perf_event_open failed (%s), no counters\n",
+            strerror(errno));
+    return false;
+  }
+  if (exclude_kernel)
+    fprintf(stderr, "perf counters limited to user space\n");
+  ioctl(perf.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  owner = true;
+  return true;
+}
+
+bool PerfEnabled(void)
+{
+  return perf.leader >= 0;
+}
+
+/* Read all counters, scaled for multiplexing */
+static void read_counters(uint64_t values[PERF_COUNTERS])
+{
+  uint64_t buf[3 + PERF_COUNTERS];
+  double scale = 1.0;
+  int i;
+
+  memset(values, 0, PERF_COUNTERS * sizeof(values[0]));
+  if (read(perf.leader, buf, sizeof(buf)) < (ssize_t) (3 * sizeof(buf[0])))
+    return;
+  if (buf[2] && buf[2] < buf[1])
+    scale = (double) buf[1] / buf[2];
+  for (i = 0; i < PERF_COUNTERS; i++)
+    if (perf.slot[i] >= 0 && perf.slot[i] < buf[0])
+      values[i] = buf[3 + perf.slot[i]] * scale;
+}
+
+void PerfBegin(struct perf_phase *phase)
+{
+  if (perf.leader < 0 || !owner)
+    return;
+  phase->start_time = now();
+  read_counters(phase->start);
+}
+
+void PerfEnd(struct perf_phase *phase)
+{
+  uint64_t values[PERF_COUNTERS];
+  int i;
+
+  if (perf.leader < 0 || !owner)
+    return;
+  read_counters(values);
+  for (i = 0; i < PERF_COUNTERS; i++)
+    if (values[i] > phase->start[i])
+      phase->counts[i] += values[i] - phase->start[i];
+  phase->seconds += now() - phase->start_time;
+  phase->runs++;
+}
+
+void PerfReset(struct perf_phase *phases, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    phases[i].runs = 0;
+    phases[i].seconds = 0.0;
+    memset(phases[i].counts, 0, sizeof(phases[i].counts));
+  }
+}
+
+void PerfReport(const char *label, const struct perf_phase *phases,
+                int count, FILE *json)
+{
+  int i, c;
+
+  if (perf.leader < 0 || !owner)
+    return;
+  for (i = 0; i < count; i++) {
+    const struct perf_phase *p = &phases[i];
+    if (!p->runs)
+      continue;
+    printf("%s perf %-8s %llu runs, %.3f ms", label, p->name,
+           (unsigned long long) p->runs, p->seconds * 1000.0 / p->runs);
+    for (c = 0; c < PERF_COUNTERS; c++) {
+      if (perf.slot[c] >= 0)
+        printf(", %s %.0f", counters[c].name,
+               (double) p->counts[c] / p->runs);
+    }
+    if (perf.slot[PERF_INSTRUCTIONS] >= 0 && perf.slot[PERF_CYCLES] >= 0 &&
+        p->counts[PERF_CYCLES])
+      printf(", ipc %.2f", (double) p->counts[PERF_INSTRUCTIONS] /
+                           p->counts[PERF_CYCLES]);
+    printf(" (per run)\n");
+  }
+
+  if (json) {
+    fprintf(json, "{\"report\":\"%s-perf\"", label);
+    for (i = 0; i < count; i++) {
+      const struct perf_phase *p = &phases[i];
+      if (!p->runs)
+        continue;
+      fprintf(json, ",\"%s\":{\"runs\":%llu,\"ms_per_run\":%.3f", p->name,
+              (unsigned long long) p->runs, p->seconds * 1000.0 / p->runs);
+      for (c = 0; c < PERF_COUNTERS; c++)
+        if (perf.slot[c] >= 0)
+          fprintf(json, ",\"%s\":%.1f", counters[c].name,
+                  (double) p->counts[c] / p->runs);
+      fprintf(json, "}");
+    }
+    fprintf(json, "}\n");
+    fflush(json);
+  }
+}
+
+void PerfRelease(void)
+{
+  int i;
+
+  for (i = 0; i < PERF_COUNTERS; i++) {
+    if (perf.opened && perf.fds[i] >= 0 && perf.fds[i] != perf.leader)
+      close(perf.fds[i]);
+  }
+  if (perf.leader >= 0)
+    close(perf.leader);
+  memset(&perf, 0, sizeof(perf));
+  perf.leader = -1;
+  owner = false;
+}
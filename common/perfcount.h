@@ -0,0 +1,73 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Hardware and software counters from perf_event_open(), read around
+ * named phases of the calling thread. Everything is a no-op until
+ * PerfInit() succeeded, so phases can be bracketed unconditionally.
+ */
+enum perf_counter {
+  PERF_INSTRUCTIONS,
+  PERF_CYCLES,
+  PERF_CACHE_MISSES,
+  PERF_CONTEXT_SWITCHES,
+  PERF_PAGE_FAULTS,
+  PERF_COUNTERS,
+};
+
+struct perf_phase {
+  const char *name;
+  uint64_t runs;
+  double seconds;
+  uint64_t counts[PERF_COUNTERS];
+  /* Readings at PerfBegin() */
+  uint64_t start[PERF_COUNTERS];
+  double start_time;
+};
+
+/*
+ * Open the counters for the calling thread. Counters the CPU or kernel
+ * doesn't offer are left out; returns false if none could be opened.
+ * Phases and reports on other threads are no-ops.
+ */
+bool PerfInit(void);
+bool PerfEnabled(void);
+
+void PerfBegin(struct perf_phase *phase);
+void PerfEnd(struct perf_phase *phase);
+void PerfReset(struct perf_phase *phases, int count);
+
+/* Print per-run averages of each phase, and JSON to json unless NULL */
+void PerfReport(const char *label, const struct perf_phase *phases,
+                int count, FILE *json);
+
+void PerfRelease(void);
+
+#endif
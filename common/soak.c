@@ -0,0 +1,288 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Growth rates are least squares slopes over all samples since the
+ * baseline, kept as running sums so hours of samples take no memory.
+ *
+ * GPU memory comes from the drm-resident-* (or older drm-memory-*) keys
+ * of /proc/self/fdinfo, which DRM drivers fill in for each open device
+ * file. A client opened through several fds is only counted once.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "soak.h"
+
+/* Samples before the baseline, the first only covers a single build */
+#define SETTLE_SAMPLES 2
+/* DRM clients told apart by drm-client-id */
+#define MAX_DRM_CLIENTS 16
+
+enum soak_metric {
+  SOAK_RSS,         /* kB */
+  SOAK_GPU,         /* kB */
+  SOAK_FDS,
+  SOAK_MAPPINGS,
+  SOAK_METRICS,
+};
+
+static const char *metric_names[SOAK_METRICS] = {
+  "rss_kb", "gpu_kb", "fds", "mappings",
+};
+
+/* Running sums for a least squares fit of value over time */
+struct trend {
+  double n, t, v, tt, tv;
+};
+
+static struct {
+  bool enabled;
+  double period, max_growth_kb;
+  double start, next;
+  int samples;
+  double baseline_time, last_time;
+  double baseline[SOAK_METRICS], last[SOAK_METRICS];
+  struct trend trend[SOAK_METRICS];
+  bool failed;
+} soak;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static double rss_kb(void)
+{
+  unsigned long size, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+
+  if (!f)
+    return 0.0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024.0);
+}
+
+static double count_mappings(void)
+{
+  char buf[4096];
+  size_t n, i;
+  double lines = 0;
+  FILE *f = fopen("/proc/self/maps", "r");
+
+  if (!f)
+    return 0.0;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    for (i = 0; i < n; i++)
+      lines += buf[i] == '\n';
+  fclose(f);
+  return lines;
+}
+
+/* Resident GPU memory of one fd in kB, -1 if it is not a DRM client */
+static double drm_fd_kb(const char *fd, unsigned long *client)
+{
+  char path[64], line[256];
+  double resident = 0.0, memory = 0.0;
+  bool drm = false, has_resident = false;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/proc/self/fdinfo/%s", fd);
+  f = fopen(path, "r");
+  if (!f)
+    return -1.0;
+  while (fgets(line, sizeof(line), f)) {
+    char *colon = strchr(line, ':');
+    unsigned long long value;
+    char unit[8] = "";
+    double kb;
+
+    if (strncmp(line, "drm-", 4) != 0 || !colon)
+      continue;
+    if (strncmp(line, "drm-client-id:", 14) == 0) {
+      *client = strtoul(colon + 1, NULL, 10);
+      drm = true;
+      continue;
+    }
+    if (sscanf(colon + 1, "%llu %7s", &value, unit) < 1)
+      continue;
+    kb = strcmp(unit, "KiB") == 0 ? value :
+         strcmp(unit, "MiB") == 0 ? value * 1024.0 :
+         strcmp(unit, "GiB") == 0 ? value * 1048576.0 : value / 1024.0;
+    if (strncmp(line, "drm-resident-", 13) == 0) {
+      resident += kb;
+      has_resident = true;
+    } else if (strncmp(line, "drm-memory-", 11) == 0) {
+      memory += kb;
+    }
+  }
+  fclose(f);
+  if (!drm)
+    return -1.0;
+  return has_resident ? resident : memory;
+}
+
+/* Count open fds and sum the GPU memory of the DRM clients among them */
+static void scan_fds(double *fds, double *gpu_kb)
+{
+  unsigned long clients[MAX_DRM_CLIENTS];
+  int num_clients = 0, i;
+  struct dirent *entry;
+  DIR *dir = opendir("/proc/self/fdinfo");
+
+  *fds = *gpu_kb = 0.0;
+  if (!dir)
+    return;
+  while ((entry = readdir(dir))) {
+    unsigned long client;
+    double kb;
+
+    if (entry->d_name[0] == '.' || atoi(entry->d_name) == dirfd(dir))
+      continue;
+    *fds += 1.0;
+    kb = drm_fd_kb(entry->d_name, &client);
+    if (kb < 0.0)
+      continue;
+    for (i = 0; i < num_clients && clients[i] != client; i++)
+      ;
+    if (i < num_clients)
+      continue;
+    if (num_clients < MAX_DRM_CLIENTS)
+      clients[num_clients++] = client;
+    *gpu_kb += kb;
+  }
+  closedir(dir);
+}
+
+static double slope(const struct trend *tr)
+{
+  double d = tr->n * tr->tt - tr->t * tr->t;
+  return d > 0.0 ? (tr->n * tr->tv - tr->t * tr->v) / d : 0.0;
+}
+
+void SoakStart(double period, double max_growth_mb)
+{
+  soak.enabled = true;
+  soak.period = period;
+  soak.max_growth_kb = max_growth_mb * 1024.0;
+  soak.start = now();
+  soak.next = soak.start + period;
+}
+
+bool SoakEnabled(void)
+{
+  return soak.enabled;
+}
+
+int SoakPoll(void)
+{
+  double t = now(), v[SOAK_METRICS], elapsed;
+  int i;
+
+  if (!soak.enabled || t < soak.next)
+    return 0;
+  soak.next += soak.period;
+  if (soak.next < t)
+    soak.next = t + soak.period;
+
+  v[SOAK_RSS] = rss_kb();
+  scan_fds(&v[SOAK_FDS], &v[SOAK_GPU]);
+  v[SOAK_MAPPINGS] = count_mappings();
+  memcpy(soak.last, v, sizeof(v));
+  soak.last_time = t;
+  elapsed = t - soak.start;
+
+  if (++soak.samples == SETTLE_SAMPLES) {
+    memcpy(soak.baseline, v, sizeof(v));
+    soak.baseline_time = t;
+  }
+  if (soak.samples >= SETTLE_SAMPLES) {
+    for (i = 0; i < SOAK_METRICS; i++) {
+      struct trend *tr = &soak.trend[i];
+      double x = (t - soak.baseline_time) / 3600.0;
+      tr->n += 1.0;
+      tr->t += x;
+      tr->v += v[i];
+      tr->tt += x * x;
+      tr->tv += x * v[i];
+    }
+  }
+
+  printf("soak %.0f s: rss %.1f MB, gpu %.1f MB, %.0f fds, %.0f mappings",
+         elapsed, v[SOAK_RSS] / 1024.0, v[SOAK_GPU] / 1024.0, v[SOAK_FDS],
+         v[SOAK_MAPPINGS]);
+  if (soak.samples > SETTLE_SAMPLES)
+    printf(" (rss %+.1f MB, %+.2f MB/h)",
+           (v[SOAK_RSS] - soak.baseline[SOAK_RSS]) / 1024.0,
+           slope(&soak.trend[SOAK_RSS]) / 1024.0);
+  printf("\n");
+  fflush(stdout);
+
+  if (soak.samples >= SETTLE_SAMPLES &&
+      (v[SOAK_RSS] - soak.baseline[SOAK_RSS] > soak.max_growth_kb ||
+       v[SOAK_GPU] - soak.baseline[SOAK_GPU] > soak.max_growth_kb)) {
+    soak.failed = true;
+    return -1;
+  }
+  return 1;
+}
+
+void SoakReport(const char *label, FILE *json)
+{
+  int i;
+
+  if (!soak.enabled)
+    return;
+  if (soak.samples <= SETTLE_SAMPLES) {
+    printf("%s soak: too short for a baseline, %d samples every %.0f s\n",
+           label, soak.samples, soak.period);
+    return;
+  }
+  printf("%s soak over %.1f h: %s\n", label,
+         (soak.last_time - soak.baseline_time) / 3600.0,
+         soak.failed ? "FAIL memory grew past the limit" : "ok");
+  for (i = 0; i < SOAK_METRICS; i++)
+    printf("  %-8s %10.0f -> %10.0f, %+.1f/h\n", metric_names[i],
+           soak.baseline[i], soak.last[i], slope(&soak.trend[i]));
+  if (json) {
+    fprintf(json, "{\"report\":\"%s-soak\",\"hours\":%.3f,\"failed\":%s",
+            label, (soak.last_time - soak.baseline_time) / 3600.0,
+            soak.failed ? "true" : "false");
+    for (i = 0; i < SOAK_METRICS; i++)
+      fprintf(json, ",\"%s\":{\"baseline\":%.0f,\"last\":%.0f,"
+              "\"per_hour\":%.1f}", metric_names[i], soak.baseline[i],
+              soak.last[i], slope(&soak.trend[i]));
+    fprintf(json, "}\n");
+    fflush(json);
+  }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SOAK_H
+#define SOAK_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Leak tracking for long burn-in runs. Every period seconds the process'
+ * RSS, open file descriptors, memory mappings and the GPU memory DRM
+ * drivers account to it in fdinfo are sampled. Growth is measured from a
+ * baseline taken once the workload has been torn down and rebuilt, so
+ * caches that fill on first use do not count as leaks.
+ */
+void SoakStart(double period, double max_growth_mb);
+bool SoakEnabled(void);
+
+/*
+ * Call from the workload's loop. Returns 1 when a sample was taken, and
+ * the workload should tear down and rebuild what it allocates, 0 when no
+ * sample was due, and -1 once RSS or GPU memory grew past the threshold.
+ */
+int SoakPoll(void);
+
+/* Print baseline, growth and growth rates, and JSON to json unless NULL */
+void SoakReport(const char *label, FILE *json);
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "startup.h"
+#include "trace.h"
+
+#define MAX_PHASES 16
+
+struct startup_phase {
+  char name[40];
+  double begin, end;    /* CLOCK_MONOTONIC seconds, end 0 while running */
+  uint64_t trace_begin;
+};
+
+static struct {
+  struct startup_phase phases[MAX_PHASES];
+  int count;
+  /* Seconds from exec to the first StartupBegin(), < 0 if unknown */
+  double before;
+  bool reported;
+} startup;
+
+/* Phases are timed on the thread that began the first one only */
+static __thread bool owner;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Seconds since the process was started, < 0 if /proc can't tell */
+static double process_age(void)
+{
+  char buf[1024], *p;
+  unsigned long long start_ticks;
+  struct timespec ts;
+  size_t n;
+  int field;
+  FILE *f = fopen("/proc/self/stat", "r");
+
+  if (!f)
+    return -1.0;
+  n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+  // The command name may contain anything, fields resume after its ')'
+  p = strrchr(buf, ')');
+  if (!p)
+    return -1.0;
+  // starttime is field 22, each space skipped lands before the next field
+  for (field = 3; field <= 22 && p; field++)
+    p = strchr(p + 1, ' ');
+  if (!p || sscanf(p, " %llu", &start_ticks) != 1)
+    return -1.0;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0 -
+         (double) start_ticks / sysconf(_SC_CLK_TCK);
+}
+
+static struct startup_phase *find(const char *name)
+{
+  int i;
+
+  for (i = 0; i < startup.count; i++)
+    if (strcmp(startup.phases[i].name, name) == 0)
+      return &startup.phases[i];
+  return NULL;
+}
+
+void StartupBegin(const char *phase)
+{
+  struct startup_phase *p;
+
+  if (startup.count && !owner)
+    return;
+  if (startup.reported || find(phase) || startup.count == MAX_PHASES)
+    return;
+  if (!startup.count) {
+    startup.before = process_age();
+    owner = true;
+  }
+  p = &startup.phases[startup.count++];
+  snprintf(p->name, sizeof(p->name), "%s", phase);
+  p->trace_begin = TraceNow();
+  p->begin = now();
+}
+
+void StartupEnd(const char *phase)
+{
+  struct startup_phase *p;
+
+  if (!owner)
+    return;
+  p = find(phase);
+  if (startup.reported || !p || p->end > 0.0)
+    return;
+  p->end = now();
+  TraceSpan(p->name, "startup", p->trace_begin);
+}
+
+void StartupReport(FILE *json)
+{
+  double origin, last = 0.0;
+  int i;
+
+  if (startup.reported || !startup.count)
+    return;
+  startup.reported = true;
+  // Offsets count from exec when known, from the first phase otherwise
+  origin = startup.phases[0].begin - (startup.before > 0.0 ? startup.before
+                                                          : 0.0);
+  if (startup.before > 0.0)
+    printf("startup %-28s %8.2f ms\n", "exec to first phase",
+           startup.before * 1000.0);
+  for (i = 0; i < startup.count; i++) {
+    const struct startup_phase *p = &startup.phases[i];
+    if (p->end <= 0.0)
+      continue;
+    printf("startup %-28s %8.2f ms, done at %.2f ms\n", p->name,
+           (p->end - p->begin) * 1000.0, (p->end - origin) * 1000.0);
+    if (p->end > last)
+      last = p->end;
+  }
+  printf("startup total %.2f ms\n", (last - origin) * 1000.0);
+
+  if (json) {
+    fprintf(json, "{\"report\":\"startup\",\"total_ms\":%.3f",
+            (last - origin) * 1000.0);
+    if (startup.before > 0.0)
+      fprintf(json, ",\"exec_ms\":%.3f", startup.before * 1000.0);
+    for (i = 0; i < startup.count; i++) {
+      const struct startup_phase *p = &startup.phases[i];
+      if (p->end > 0.0)
+        fprintf(json, ",\"%s\":{\"ms\":%.3f,\"done_ms\":%.3f}", p->name,
+                (p->end - p->begin) * 1000.0, (p->end - origin) * 1000.0);
+    }
+    fprintf(json, "}\n");
+    fflush(json);
+  }
+  fflush(stdout);
+}
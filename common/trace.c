@@ -0,0 +1,342 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Every thread owns a single producer, single consumer ring: the thread
+ * publishes events by moving head, the writer thread consumes them by
+ * moving tail. Rings are allocated on a thread's first span and stay
+ * linked for the life of the process, so a span emitted while the trace
+ * is being closed at most gets lost. When a thread exits its ring is
+ * handed to the next new thread once drained, so short-lived threads
+ * (e.g. a loader per scene rebuild) don't add a ring each.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Spans buffered per thread between two flushes */
+#define TRACE_RING 4096
+/* Writer thread period */
+#define FLUSH_INTERVAL_MS 100
+/* Named tracks get made up thread ids past any real one */
+#define MAX_TRACKS 16
+#define TRACK_TID_BASE 0x40000000
+
+struct trace_event {
+  const char *name;
+  const char *category;
+  const char *track;    /* NULL for the emitting thread */
+  uint64_t start, duration;
+};
+
+struct trace_thread {
+  struct trace_event ring[TRACE_RING];
+  atomic_uint head, tail;
+  atomic_int tid;
+  const char *_Atomic name;
+  /* name and tid already written by the writer thread */
+  const char *named;
+  int named_tid;
+  /* Set once the owning thread exited, cleared by the thread reusing it */
+  atomic_bool exited;
+  uint64_t dropped;
+  struct trace_thread *next;
+};
+
+static struct {
+  FILE *file;
+  atomic_bool enabled;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t stop_cond;
+  bool stop;
+  struct trace_thread *_Atomic threads;
+  const char *tracks[MAX_TRACKS];
+  int num_tracks;
+  bool first;           /* no event written yet, no comma needed */
+  int pid;
+} trace = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct trace_thread *self;
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Runs at thread exit, the ring can be reused once drained */
+static void thread_exited(void *arg)
+{
+  struct trace_thread *t = arg;
+
+  atomic_store(&t->exited, true);
+}
+
+static void create_exit_key(void)
+{
+  pthread_key_create(&exit_key, thread_exited);
+}
+
+/* Claim the ring of an exited thread the writer has drained */
+static struct trace_thread *reuse_ring(void)
+{
+  struct trace_thread *t;
+  bool exited;
+
+  for (t = atomic_load(&trace.threads); t; t = t->next) {
+    exited = true;
+    if (!atomic_compare_exchange_strong(&t->exited, &exited, false))
+      continue;
+    if (atomic_load_explicit(&t->tail, memory_order_acquire) ==
+        atomic_load_explicit(&t->head, memory_order_relaxed)) {
+      atomic_store(&t->name, NULL);
+      return t;
+    }
+    atomic_store(&t->exited, true);
+  }
+  return NULL;
+}
+
+static struct trace_thread *this_thread(void)
+{
+  struct trace_thread *t = self;
+
+  if (t)
+    return t;
+  pthread_once(&exit_key_once, create_exit_key);
+  t = reuse_ring();
+  if (t) {
+    atomic_store(&t->tid, syscall(SYS_gettid));
+  } else {
+    t = calloc(1, sizeof(*t));
+    if (!t)
+      return NULL;
+    t->tid = syscall(SYS_gettid);
+    t->next = atomic_load(&trace.threads);
+    while (!atomic_compare_exchange_weak(&trace.threads, &t->next, t))
+      ;
+  }
+  pthread_setspecific(exit_key, t);
+  self = t;
+  return t;
+}
+
+static void push(const struct trace_event *event)
+{
+  struct trace_thread *t = this_thread();
+  unsigned head;
+
+  if (!t)
+    return;
+  head = atomic_load_explicit(&t->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&t->tail, memory_order_acquire) ==
+      TRACE_RING) {
+    t->dropped++;
+    return;
+  }
+  t->ring[head % TRACE_RING] = *event;
+  atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
+
+static void write_separator(void)
+{
+  fputs(trace.first ? "\n" : ",\n", trace.file);
+  trace.first = false;
+}
+
+static void write_name(int tid, const char *name)
+{
+  write_separator();
+  fprintf(trace.file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", trace.pid, tid, name);
+}
+
+static int track_tid(const char *track)
+{
+  int i;
+
+  for (i = 0; i < trace.num_tracks; i++)
+    if (strcmp(trace.tracks[i], track) == 0)
+      return TRACK_TID_BASE + i;
+  if (trace.num_tracks == MAX_TRACKS)
+    return TRACK_TID_BASE + MAX_TRACKS;
+  trace.tracks[trace.num_tracks] = track;
+  write_name(TRACK_TID_BASE + trace.num_tracks, track);
+  return TRACK_TID_BASE + trace.num_tracks++;
+}
+
+/* Drain every ring into the file, writer thread or TraceClose() only */
+static void flush(void)
+{
+  struct trace_thread *t;
+
+  for (t = atomic_load(&trace.threads); t; t = t->next) {
+    unsigned tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&t->head, memory_order_acquire);
+    // tid first: a reused ring clears name before it gets the new tid
+    int thread_tid = atomic_load(&t->tid);
+    const char *name = atomic_load(&t->name);
+
+    // A reused ring may carry the same name for another thread
+    if (name && (name != t->named || thread_tid != t->named_tid)) {
+      write_name(thread_tid, name);
+      t->named = name;
+      t->named_tid = thread_tid;
+    }
+    for (; tail != head; tail++) {
+      const struct trace_event *e = &t->ring[tail % TRACE_RING];
+      int tid = e->track ? track_tid(e->track) : thread_tid;
+      write_separator();
+      fprintf(trace.file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+              "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}", e->name,
+              e->category, e->start / 1000.0, e->duration / 1000.0,
+              trace.pid, tid);
+    }
+    atomic_store_explicit(&t->tail, tail, memory_order_release);
+  }
+  fflush(trace.file);
+}
+
+static void *TraceWriter(void *arg)
+{
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  pthread_mutex_lock(&trace.lock);
+  while (!trace.stop) {
+    next.tv_nsec += FLUSH_INTERVAL_MS * 1000000;
+    next.tv_sec += next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    while (!trace.stop &&
+           pthread_cond_timedwait(&trace.stop_cond, &trace.lock, &next) == 0)
+      ;
+    flush();
+  }
+  pthread_mutex_unlock(&trace.lock);
+  return NULL;
+}
+
+bool TraceOpen(const char *path)
+{
+  pthread_condattr_t attr;
+
+  trace.file = fopen(path, "w");
+  if (!trace.file) {
+    fprintf(stderr, "could not open trace file %s\n", path);
+    return false;
+  }
+  fputs("[", trace.file);
+  trace.first = true;
+  trace.pid = getpid();
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&trace.stop_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&trace.writer, NULL, TraceWriter, NULL) != 0) {
+    fclose(trace.file);
+    trace.file = NULL;
+    return false;
+  }
+  atomic_store(&trace.enabled, true);
+  return true;
+}
+
+bool TraceEnabled(void)
+{
+  return atomic_load_explicit(&trace.enabled, memory_order_relaxed);
+}
+
+uint64_t TraceNow(void)
+{
+  return TraceEnabled() ? monotonic_ns() : 0;
+}
+
+void TraceThreadName(const char *name)
+{
+  struct trace_thread *t;
+
+  if (!TraceEnabled() || !(t = this_thread()))
+    return;
+  atomic_store(&t->name, name);
+}
+
+void TraceSpan(const char *name, const char *category, uint64_t start)
+{
+  struct trace_event event = { name, category, NULL, start, 0 };
+
+  // start is 0 when tracing got enabled in the middle of the span
+  if (!TraceEnabled() || !start)
+    return;
+  event.duration = monotonic_ns() - start;
+  push(&event);
+}
+
+void TraceTrackSpan(const char *track, const char *name,
+                    const char *category, uint64_t start, uint64_t end)
+{
+  struct trace_event event = { name, category, track, start, end - start };
+
+  if (!TraceEnabled() || end < start)
+    return;
+  push(&event);
+}
+
+void TraceClose(void)
+{
+  struct trace_thread *t;
+  uint64_t dropped = 0;
+
+  if (!atomic_exchange(&trace.enabled, false))
+    return;
+  pthread_mutex_lock(&trace.lock);
+  trace.stop = true;
+  pthread_cond_signal(&trace.stop_cond);
+  pthread_mutex_unlock(&trace.lock);
+  pthread_join(trace.writer, NULL);
+
+  flush();
+  fputs("\n]\n", trace.file);
+  fclose(trace.file);
+  trace.file = NULL;
+  for (t = atomic_load(&trace.threads); t; t = t->next)
+    dropped += t->dropped;
+  if (dropped)
+    fprintf(stderr, "trace: dropped %llu spans, rings full\n",
+            (unsigned long long) dropped);
+}
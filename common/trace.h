@@ -0,0 +1,63 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Chrome trace-event JSON output, loadable in Perfetto or chrome://tracing.
+ * Spans are complete ("X") events timed on CLOCK_MONOTONIC. Each thread
+ * appends to its own ring and a writer thread drains the rings into the
+ * file, so emitting a span never takes a lock or touches the file. Spans
+ * are dropped when a ring is full. Everything is a no-op until TraceOpen()
+ * succeeded.
+ *
+ * Names, categories and tracks are stored by pointer and must be string
+ * literals or otherwise outlive the trace.
+ */
+bool TraceOpen(const char *path);
+bool TraceEnabled(void);
+
+/* Timestamp in ns to start a span with, 0 while tracing is off */
+uint64_t TraceNow(void);
+
+/* Label the calling thread in the timeline */
+void TraceThreadName(const char *name);
+
+/* Span on the calling thread from start, a TraceNow() value, until now */
+void TraceSpan(const char *name, const char *category, uint64_t start);
+
+/*
+ * Span on a separate named timeline, e.g. work timed by a device rather
+ * than a thread. start and end are CLOCK_MONOTONIC ns.
+ */
+void TraceTrackSpan(const char *track, const char *name,
+                    const char *category, uint64_t start, uint64_t end);
+
+/* Write out the remaining spans and close the file, safe to call twice */
+void TraceClose(void);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Attach to the metrics segment of a running gears or clexample and print
+ * its records as they are published, plus the live counters.
+ *
+ * Usage: metricsmon [-once] [-interval MS] NAME
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static const char *counter_names[METRIC_COUNTERS] = {
+  "frames", "checks", "failed", "kernels",
+};
+
+/* Labels of the values of each record kind */
+static const char *value_names[][METRICS_VALUES] = {
+  [METRICS_FRAME_TIMES] = { "frames", "fps", "p50", "p90", "p99", "p99.9",
+                            "max" },
+  [METRICS_CHECK] = { "index", "passed", "bad", "max_delta", "psnr" },
+  [METRICS_KERNEL] = { "exec_ms", "wait_ms" },
+};
+
+static const char *kind_names[] = {
+  [METRICS_FRAME_TIMES] = "frame-times",
+  [METRICS_CHECK] = "check",
+  [METRICS_KERNEL] = "kernel",
+};
+
+static void print_record(int ring, const struct metrics_record *r)
+{
+  unsigned i;
+
+  printf("%.3f [%d] %-11s %-24s", r->time_ns / 1e9, ring,
+         r->kind < sizeof(kind_names) / sizeof(kind_names[0]) &&
+         kind_names[r->kind] ? kind_names[r->kind] : "?", r->name);
+  for (i = 0; i < r->count && i < METRICS_VALUES; i++) {
+    const char *label = r->kind < sizeof(value_names) / sizeof(value_names[0])
+                        ? value_names[r->kind][i] : NULL;
+    printf(" %s %.6g", label ? label : "?", r->values[i]);
+  }
+  printf("\n");
+}
+
+/*
+ * Copy record n of a ring. Returns 1 when copied, 0 when it is not
+ * written yet and -1 when the writer already overwrote it.
+ */
+static int read_record(struct metrics_ring *ring, uint64_t n,
+                       struct metrics_record *out)
+{
+  struct metrics_record *r = &ring->records[n % METRICS_RING];
+  uint64_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+
+  if (seq < 2 * n + 2)
+    return 0;
+  if (seq > 2 * n + 2)
+    return -1;
+  out->time_ns = r->time_ns;
+  out->kind = r->kind;
+  out->count = r->count;
+  memcpy(out->name, r->name, sizeof(out->name));
+  memcpy(out->values, r->values, sizeof(out->values));
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&r->seq, memory_order_relaxed) != seq)
+    return -1;
+  out->name[sizeof(out->name) - 1] = '\0';
+  return 1;
+}
+
+static void print_counters(struct metrics_segment *segment, uint64_t *last)
+{
+  bool changed = false;
+  int i;
+
+  for (i = 0; i < METRIC_COUNTERS; i++) {
+    uint64_t v = atomic_load_explicit(&segment->counters[i],
+                                      memory_order_relaxed);
+    changed |= v != last[i];
+    last[i] = v;
+  }
+  if (!changed)
+    return;
+  printf("%s[%d]", segment->tool, segment->pid);
+  for (i = 0; i < METRIC_COUNTERS; i++)
+    printf(" %s %llu", counter_names[i], (unsigned long long) last[i]);
+  printf("\n");
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-once] [-interval MS] NAME\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  struct metrics_segment *segment;
+  uint64_t next[METRICS_WRITERS] = { 0 }, counters[METRIC_COUNTERS] = { 0 };
+  const char *name = NULL;
+  char path[64];
+  bool once = false;
+  int interval_ms = 200, fd, i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-once") == 0)
+      once = true;
+    else if (strcmp(argv[i], "-interval") == 0 && i + 1 < argc &&
+             (interval_ms = atoi(argv[i + 1])) > 0)
+      i++;
+    else if (argv[i][0] != '-' && !name)
+      name = argv[i];
+    else
+      usage(argv[0]);
+  }
+  if (!name)
+    usage(argv[0]);
+
+  snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+  fd = shm_open(path, O_RDONLY, 0);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  segment = mmap(NULL, sizeof(*segment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  if (segment->magic != METRICS_MAGIC) {
+    fprintf(stderr, "%s: not a metrics segment, or not initialized yet\n",
+            path);
+    return 1;
+  }
+  atomic_thread_fence(memory_order_acquire);
+  if (segment->version != METRICS_VERSION ||
+      segment->writers != METRICS_WRITERS ||
+      segment->ring_size != METRICS_RING) {
+    fprintf(stderr, "%s: metrics version %u, this reader handles %u\n", path,
+            segment->version, METRICS_VERSION);
+    return 1;
+  }
+
+  // Start with what the rings still hold
+  for (i = 0; i < METRICS_WRITERS; i++) {
+    uint64_t head = atomic_load(&segment->rings[i].head);
+    next[i] = head > METRICS_RING ? head - METRICS_RING : 0;
+  }
+
+  while (1) {
+    bool closed = atomic_load(&segment->closed);
+
+    print_counters(segment, counters);
+    for (i = 0; i < METRICS_WRITERS; i++) {
+      struct metrics_ring *ring = &segment->rings[i];
+      uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+      struct metrics_record r;
+
+      while (next[i] < head) {
+        int ret = read_record(ring, next[i], &r);
+        if (ret == 0)
+          break;
+        if (ret < 0) {
+          // Lapped by the writer, skip to the oldest record still there.
+          // The writer may have moved on since head was read, and record
+          // next[i] is gone either way, so never go back to it.
+          uint64_t oldest;
+
+          head = atomic_load_explicit(&ring->head, memory_order_acquire);
+          oldest = head > METRICS_RING ? head - METRICS_RING : 0;
+          if (oldest < next[i] + 1)
+            oldest = next[i] + 1;
+          printf("[%d] missed %llu records\n", i,
+                 (unsigned long long) (oldest - next[i]));
+          next[i] = oldest;
+          continue;
+        }
+        print_record(i, &r);
+        next[i]++;
+      }
+    }
+    fflush(stdout);
+    if (once || closed)
+      break;
+    usleep(interval_ms * 1000);
+  }
+  if (!once)
+    printf("%s[%d] exited\n", segment->tool, segment->pid);
+  return 0;
+}
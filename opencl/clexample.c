@@ -26,6 +26,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "perfcount.h"
+#include "soak.h"
+#include "startup.h"
+#include "trace.h"
 
 /* Max no of CL implementations, 5 should be enough to find CPU & GPU */
 #define MAX_PLATFORMS 5
@@ -45,23 +53,76 @@ const char *kKernels =
 const cl_int kAdd = 2;
 const size_t kArraySize = 1024;
 
+/* CPU counters for the steps of Compute(), with -perf */
+enum { PHASE_BUILD, PHASE_WRITE, PHASE_KERNELS, PHASE_READ, NUM_PHASES };
+static struct perf_phase phases[NUM_PHASES] = {
+  { .name = "build" }, { .name = "write" },
+  { .name = "kernels" }, { .name = "read" },
+};
+
+/*
+ * Put a kernel's execution on the device's trace track and publish its
+ * timings with -metrics. Device clocks are not CLOCK_MONOTONIC, so the
+ * trace times are lined up on the host time the kernel was queued at.
+ */
+static void ReportKernel(const char *track, const char *name, cl_event event,
+                         uint64_t queued) {
+  cl_ulong t_queued, t_start, t_end;
+
+  if (!event)
+    return;
+  if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED,
+                              sizeof(t_queued), &t_queued, NULL) == CL_SUCCESS &&
+      clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                              sizeof(t_start), &t_start, NULL) == CL_SUCCESS &&
+      clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                              sizeof(t_end), &t_end, NULL) == CL_SUCCESS) {
+    TraceTrackSpan(track, name, "kernel", queued + (t_start - t_queued),
+                   queued + (t_end - t_queued));
+    if (MetricsEnabled()) {
+      double values[] = { (t_end - t_start) / 1e6, (t_start - t_queued) / 1e6 };
+      char label[32];
+
+      snprintf(label, sizeof(label), "%s/%s", track, name);
+      MetricsPublish(METRICS_KERNEL, label, values, 2);
+      MetricsAdd(METRIC_KERNELS, 1);
+    }
+  }
+  clReleaseEvent(event);
+}
+
 /*
  * Function to carry out the CL elementwise calculations
  * (out_array = in_array*in_array + in_array + 2)
+ * With -trace or -metrics, the kernels' device times are reported under
+ * the name device.
  */
-void Compute(cl_context ctx, cl_command_queue queue,
+void Compute(cl_context ctx, cl_command_queue queue, const char *device,
             int *in_array, int *out_array, size_t size) {
   cl_program program;
   cl_int err;
   cl_mem device_mem_1, device_mem_2;
   cl_kernel kernel_square, kernel_add_const, kernel_add_arrays;
+  /* Kernel completion events, only requested when they get reported */
+  cl_event events[3] = { NULL, NULL, NULL };
+  uint64_t queued[3], start;
+  bool timed = TraceEnabled() || MetricsEnabled();
+  char build[40];
 
+  /* Startup timing only records the first build on each device */
+  snprintf(build, sizeof(build), "clBuildProgram (%s)", device);
+  StartupBegin(build);
+  start = TraceNow();
+  PerfBegin(&phases[PHASE_BUILD]);
   program = clCreateProgramWithSource(ctx, 1, (const char **) &kKernels,
                                       NULL, &err);
   err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
   kernel_square = clCreateKernel(program, "square", &err);
   kernel_add_const = clCreateKernel(program, "add_const", &err);
   kernel_add_arrays = clCreateKernel(program, "add_arrays", &err);
+  PerfEnd(&phases[PHASE_BUILD]);
+  TraceSpan("build", "compute", start);
+  StartupEnd(build);
 
   /* Initialize the data buffers */
   device_mem_1 = clCreateBuffer(ctx, CL_MEM_READ_WRITE, size*sizeof(*in_array),
@@ -70,32 +131,66 @@ void Compute(cl_context ctx, cl_command_queue queue,
                         NULL, &err);
 
   /* Write and queue the input buffers */
+  PerfBegin(&phases[PHASE_WRITE]);
+  start = TraceNow();
   err = clEnqueueWriteBuffer(queue, device_mem_1, CL_TRUE, 0, size*sizeof(*in_array),
                               in_array, 0, NULL, NULL);
+  TraceSpan("write buffer 1", "compute", start);
+  start = TraceNow();
   err = clEnqueueWriteBuffer(queue, device_mem_2, CL_TRUE, 0, size*sizeof(*in_array),
                               in_array, 0, NULL, NULL);
+  TraceSpan("write buffer 2", "compute", start);
+  PerfEnd(&phases[PHASE_WRITE]);
 
   /* Calculate the square the elements of the array */
+  PerfBegin(&phases[PHASE_KERNELS]);
+  queued[0] = TraceNow();
   clSetKernelArg(kernel_square, 0, sizeof(cl_mem), &device_mem_1);
-  clEnqueueNDRangeKernel(queue, kernel_square, 1, NULL, &size, &size, 0, NULL, NULL);
+  clEnqueueNDRangeKernel(queue, kernel_square, 1, NULL, &size, &size, 0, NULL,
+                         timed ? &events[0] : NULL);
+  TraceSpan("enqueue square", "compute", queued[0]);
 
   /* Add the current result to the original array */
+  queued[1] = TraceNow();
   clSetKernelArg(kernel_add_arrays, 0, sizeof(cl_mem), &device_mem_1);
   clSetKernelArg(kernel_add_arrays, 1, sizeof(cl_mem), &device_mem_2);
-  clEnqueueNDRangeKernel(queue, kernel_add_arrays, 1, NULL, &size, &size, 0, NULL, NULL);
+  clEnqueueNDRangeKernel(queue, kernel_add_arrays, 1, NULL, &size, &size, 0, NULL,
+                         timed ? &events[1] : NULL);
+  TraceSpan("enqueue add_arrays", "compute", queued[1]);
 
   /* Add a constant to each element */
+  queued[2] = TraceNow();
   clSetKernelArg(kernel_add_const, 0, sizeof(cl_mem), &device_mem_1);
   clSetKernelArg(kernel_add_const, 1, sizeof(int), &kAdd);
-  clEnqueueNDRangeKernel(queue, kernel_add_const, 1, NULL, &size, &size, 0, NULL, NULL);
+  clEnqueueNDRangeKernel(queue, kernel_add_const, 1, NULL, &size, &size, 0, NULL,
+                         timed ? &events[2] : NULL);
+  TraceSpan("enqueue add_const", "compute", queued[2]);
+  /* Only wait here when measuring, so the kernels are not billed to read */
+  if (PerfEnabled() || timed) {
+    start = TraceNow();
+    clFinish(queue);
+    TraceSpan("finish kernels", "compute", start);
+  }
+  PerfEnd(&phases[PHASE_KERNELS]);
 
 
   /* Queue the output buffer, and kick off the calcuations */
+  PerfBegin(&phases[PHASE_READ]);
+  start = TraceNow();
   err = clEnqueueReadBuffer(queue, device_mem_1, CL_TRUE, 0, size*sizeof(*out_array),
                             out_array, 0, NULL, NULL);
   err = clFinish(queue);
+  TraceSpan("read buffer", "compute", start);
+  PerfEnd(&phases[PHASE_READ]);
+  ReportKernel(device, "square", events[0], queued[0]);
+  ReportKernel(device, "add_arrays", events[1], queued[1]);
+  ReportKernel(device, "add_const", events[2], queued[2]);
   clReleaseMemObject(device_mem_1);
   clReleaseMemObject(device_mem_2);
+  clReleaseKernel(kernel_square);
+  clReleaseKernel(kernel_add_const);
+  clReleaseKernel(kernel_add_arrays);
+  clReleaseProgram(program);
 }
 
 /* Helper function to compare results */
@@ -111,7 +206,45 @@ int CompareArrays(int *arr1, int *arr2, int no_elements) {
   return success;
 }
 
-int main( void ) {
+static double Now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Run and check one Compute() on a device, returns 1 if the result is
+ * right. Only failures are printed after the first iteration.
+ */
+int RunDevice(const char *name, cl_context ctx, cl_command_queue queue,
+              const char *track, int *in_array, int *out_array,
+              int *expected, int iteration) {
+  bool quiet = iteration > 0;
+  int ok;
+
+  memset(out_array, 0, kArraySize * sizeof(*out_array));
+  Compute(ctx, queue, track, in_array, out_array, kArraySize);
+  if (!quiet)
+    PerfReport(name, phases, NUM_PHASES, NULL);
+  PerfReset(phases, NUM_PHASES);
+
+  ok = CompareArrays(expected, out_array, kArraySize);
+  if (MetricsEnabled()) {
+    double values[] = { iteration, ok };
+    MetricsPublish(METRICS_CHECK, name, values, 2);
+    MetricsAdd(METRIC_CHECKS, 1);
+    if (!ok)
+      MetricsAdd(METRIC_FAILED_CHECKS, 1);
+  }
+  if (!ok)
+    printf("%s: FAIL Result NOT as expected\n", name);
+  else if (!quiet)
+    printf("%s: Result as expected\n", name);
+  return ok;
+}
+
+int main(int argc, char **argv) {
   cl_int err;
   cl_platform_id platform;
   cl_platform_id platforms[MAX_PLATFORMS];
@@ -121,10 +254,44 @@ int main( void ) {
   cl_command_queue queue_cpu;
   cl_command_queue queue_gpu;
   cl_event event = NULL;
+  cl_command_queue_properties queue_props = 0;
   int i, num_platforms;
+  /* -soak: sample period and limit, and how long to keep looping */
+  double soak_period = 0.0, soak_max_growth = 64.0, duration = 0.0;
+  double start;
+  int iteration, leaked = 0;
 
   int *input_arr, *result_cpu_arr, *gpu_result_arr, *expected_result_arr;
 
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-perf") == 0) {
+      PerfInit();
+    } else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+      if (!TraceOpen(argv[++i]))
+        return 1;
+      TraceThreadName("main");
+      queue_props |= CL_QUEUE_PROFILING_ENABLE;
+    } else if (strcmp(argv[i], "-metrics") == 0 && i + 1 < argc) {
+      if (!MetricsOpen(argv[++i], "clexample"))
+        return 1;
+      queue_props |= CL_QUEUE_PROFILING_ENABLE;
+    } else if (strcmp(argv[i], "-soak") == 0 && i + 1 < argc &&
+               (soak_period = atof(argv[i + 1])) > 0.0) {
+      i++;
+    } else if (strcmp(argv[i], "-soak-max-growth") == 0 && i + 1 < argc &&
+               (soak_max_growth = atof(argv[i + 1])) > 0.0) {
+      i++;
+    } else if (strcmp(argv[i], "-duration") == 0 && i + 1 < argc &&
+               (duration = atof(argv[i + 1])) > 0.0) {
+      i++;
+    } else {
+      printf("Usage: %s [-perf] [-trace FILE.json] [-metrics NAME] "
+             "[-soak S]\n       [-soak-max-growth MB] [-duration S]\n",
+             argv[0]);
+      return 1;
+    }
+  }
+
   input_arr = (int*) malloc(kArraySize * sizeof(*input_arr));
   gpu_result_arr = (int*) malloc(kArraySize * sizeof(*gpu_result_arr));
   result_cpu_arr = (int*) malloc(kArraySize * sizeof(*result_cpu_arr));
@@ -138,7 +305,9 @@ int main( void ) {
   }
 
   /* Get the platforms. */
+  StartupBegin("clGetPlatformIDs");
   err = clGetPlatformIDs(5, platforms, &num_platforms);
+  StartupEnd("clGetPlatformIDs");
 
   /* Setup one CPU and one GPU device */
   device = NULL;
@@ -149,8 +318,10 @@ int main( void ) {
       err = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_CPU,
                             1, &device, NULL);
       if (device != NULL) {
+        StartupBegin("CPU context + queue");
         ctx_cpu = clCreateContext(props, 1, &device, NULL, NULL, &err);
-        queue_cpu = clCreateCommandQueue(ctx_cpu, device, 0, &err);
+        queue_cpu = clCreateCommandQueue(ctx_cpu, device, queue_props, &err);
+        StartupEnd("CPU context + queue");
         device = NULL;
         continue;
       }
@@ -159,48 +330,65 @@ int main( void ) {
       err = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU,
                             1, &device, NULL);
       if (device != NULL) {
+        StartupBegin("GPU context + queue");
         ctx_gpu = clCreateContext(props, 1, &device, NULL, NULL, &err);
-        queue_gpu = clCreateCommandQueue(ctx_gpu, device, 0, &err);
+        queue_gpu = clCreateCommandQueue(ctx_gpu, device, queue_props, &err);
+        StartupEnd("GPU context + queue");
         device = NULL;
         continue;
       }
     }
   }
 
-  /* Run the GPU computation */
+  /* Soak runs repeat both computations until the duration is up */
+  if (soak_period > 0.0)
+    SoakStart(soak_period, soak_max_growth);
+  start = Now();
+  for (iteration = 0; ; iteration++) {
+    bool quiet = iteration > 0;
+
+    /* Run the GPU computation */
+    if (ctx_gpu)
+      RunDevice("GPU", ctx_gpu, queue_gpu, "GPU queue", input_arr,
+                gpu_result_arr, expected_result_arr, iteration);
+    else if (!quiet)
+      printf("GPU: FAIL No OpenCL implementation found\n");
+
+    /* Run the CPU computation */
+    if (ctx_cpu)
+      RunDevice("CPU", ctx_cpu, queue_cpu, "CPU queue", input_arr,
+                result_cpu_arr, expected_result_arr, iteration);
+    else if (!quiet)
+      printf("CPU: FAIL No OpenCL implementation found\n");
+    StartupReport(NULL);
+
+    if (SoakPoll() < 0) {
+      printf("FAIL : memory grew more than %.0f MB during soak\n",
+             soak_max_growth);
+      leaked = 1;
+      break;
+    }
+    if (!SoakEnabled() || (duration > 0.0 && Now() - start >= duration))
+      break;
+  }
+  SoakReport("run", NULL);
+
   if (ctx_gpu) {
-    Compute(ctx_gpu, queue_gpu, input_arr, gpu_result_arr, kArraySize);
     clReleaseCommandQueue(queue_gpu);
     clReleaseContext(ctx_gpu);
-
-    if (CompareArrays(expected_result_arr, gpu_result_arr, kArraySize))
-      printf("GPU: Result as expected\n");
-    else
-      printf("GPU: FAIL Result NOT as expected\n");
-  } else {
-    printf("GPU: FAIL No OpenCL implementation found\n");
   }
-
-  /* Run the CPU computation */
   if (ctx_cpu) {
-    Compute(ctx_cpu, queue_cpu, input_arr, result_cpu_arr, kArraySize);
     clReleaseCommandQueue( queue_cpu );
     clReleaseContext( ctx_cpu );
-
-    if (CompareArrays(expected_result_arr, result_cpu_arr, kArraySize))
-      printf("CPU: Result as expected\n");
-    else
-      printf("CPU: FAIL Result NOT as expected\n");
-  } else {
-    printf("CPU: FAIL No OpenCL implementation found\n");
   }
 
-
   /* Free the allocated memory */
   free(input_arr);
   free(result_cpu_arr);
   free(gpu_result_arr);
   free(expected_result_arr);
 
-  return 0;
+  TraceClose();
+  MetricsClose();
+  return leaked;
 }
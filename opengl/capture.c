@@ -0,0 +1,130 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "capture.h"
+
+struct capture {
+  FILE *fp;
+  int width, height;
+  int chroma_width, chroma_height;
+  /* One frame worth of Y, U and V planes */
+  uint8_t *yuv;
+};
+
+struct capture *CaptureOpen(const char *path, int width, int height,
+                            int fps_num, int fps_den)
+{
+  struct capture *capture = calloc(1, sizeof(*capture));
+
+  capture->fp = fopen(path, "w");
+  if (!capture->fp) {
+    perror(path);
+    free(capture);
+    return NULL;
+  }
+  capture->width = width;
+  capture->height = height;
+  capture->chroma_width = (width + 1) / 2;
+  capture->chroma_height = (height + 1) / 2;
+  capture->yuv = malloc((size_t) width * height +
+                        2 * (size_t) capture->chroma_width *
+                        capture->chroma_height);
+
+  fprintf(capture->fp, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg\n",
+          width, height, fps_num, fps_den);
+  return capture;
+}
+
+/* BT.601 full range coefficients in 16.16 fixed point */
+#define FIX(x) ((int) ((x) * 65536 + 0.5))
+
+static uint8_t clamp8(int v)
+{
+  return v > 255 ? 255 : v;
+}
+
+static uint8_t luma(const uint8_t *p)
+{
+  return (FIX(0.299) * p[0] + FIX(0.587) * p[1] + FIX(0.114) * p[2] +
+          (1 << 15)) >> 16;
+}
+
+int CaptureWriteFrame(struct capture *capture, const uint8_t *pixels)
+{
+  const int width = capture->width, height = capture->height;
+  const size_t stride = (size_t) width * 4;
+  uint8_t *y_plane = capture->yuv;
+  uint8_t *u_plane = y_plane + (size_t) width * height;
+  uint8_t *v_plane = u_plane +
+                     (size_t) capture->chroma_width * capture->chroma_height;
+  size_t size = v_plane - capture->yuv +
+                (size_t) capture->chroma_width * capture->chroma_height;
+
+  /* GL rows are bottom-up, Y4M rows top-down */
+  for (int y = 0; y < height; y++) {
+    const uint8_t *row = pixels + (height - 1 - y) * stride;
+    uint8_t *out = y_plane + (size_t) y * width;
+    for (int x = 0; x < width; x++)
+      out[x] = luma(row + x * 4);
+  }
+
+  /* Chroma from the average of each 2x2 block, clamped at odd edges */
+  for (int cy = 0; cy < capture->chroma_height; cy++) {
+    int y0 = 2 * cy, y1 = 2 * cy + 1 < height ? 2 * cy + 1 : 2 * cy;
+    const uint8_t *row0 = pixels + (height - 1 - y0) * stride;
+    const uint8_t *row1 = pixels + (height - 1 - y1) * stride;
+
+    for (int cx = 0; cx < capture->chroma_width; cx++) {
+      int x0 = 2 * cx, x1 = 2 * cx + 1 < width ? 2 * cx + 1 : 2 * cx;
+      int r = row0[x0 * 4] + row0[x1 * 4] + row1[x0 * 4] + row1[x1 * 4];
+      int g = row0[x0 * 4 + 1] + row0[x1 * 4 + 1] +
+              row1[x0 * 4 + 1] + row1[x1 * 4 + 1];
+      int b = row0[x0 * 4 + 2] + row0[x1 * 4 + 2] +
+              row1[x0 * 4 + 2] + row1[x1 * 4 + 2];
+      size_t i = (size_t) cy * capture->chroma_width + cx;
+
+      /* r, g, b are sums of 4 samples, hence the extra >> 2 */
+      u_plane[i] = clamp8((-FIX(0.168736) * r - FIX(0.331264) * g +
+                           FIX(0.5) * b + (128 << 18) + (1 << 17)) >> 18);
+      v_plane[i] = clamp8((FIX(0.5) * r - FIX(0.418688) * g -
+                           FIX(0.081312) * b + (128 << 18) + (1 << 17)) >> 18);
+    }
+  }
+
+  if (fputs("FRAME\n", capture->fp) == EOF ||
+      fwrite(capture->yuv, 1, size, capture->fp) != size)
+    return -1;
+  return 0;
+}
+
+int CaptureClose(struct capture *capture)
+{
+  int ret = fclose(capture->fp) == 0 ? 0 : -1;
+
+  free(capture->yuv);
+  free(capture);
+  return ret;
+}
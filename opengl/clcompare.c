@@ -0,0 +1,319 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * OpenCL golden comparison. One work group covers one tile: every work
+ * item diffs a few pixels of the tile, and the group reduces bad pixel
+ * count, max delta, sum of squares and bounding box in local memory. Only
+ * the per-tile partials are read back, and the host merges them just like
+ * the CPU per-tile path does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clcompare.h"
+
+#ifndef HAVE_OPENCL
+
+bool ClCompareInit(enum cl_compare_device type, int width, int height,
+                   int tile_size)
+{
+  fprintf(stderr, "built without OpenCL, comparing on the CPU\n");
+  return false;
+}
+
+const char *ClCompareDevice(void)
+{
+  return "none";
+}
+
+int ClCompareTiles(const uint8_t *a, const uint8_t *b,
+                   const uint8_t tolerance[4], struct img_diff *tiles)
+{
+  return -1;
+}
+
+void ClCompareRelease(void)
+{
+}
+
+#else
+
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+
+/* Max no of CL implementations to look at */
+#define MAX_PLATFORMS 5
+/* uints per tile in the partials buffer */
+#define PARTIAL_WORDS 8
+
+/*
+ * LOCAL (work group edge), TILE and WORDS come in as build options. The
+ * per-tile sum of squares is 32-bit, which is plenty for 32x32 tiles.
+ */
+static const char *kDiffKernel =
+    "__kernel __attribute__((reqd_work_group_size(LOCAL, LOCAL, 1)))\n"
+    "void diff_tiles(__global const uchar4 *a, __global const uchar4 *b,\n"
+    "                int width, int height, uchar4 tol,\n"
+    "                __global uint *partials) {\n"
+    "  __local uint bad[LOCAL * LOCAL], maxd[LOCAL * LOCAL];\n"
+    "  __local uint sse[LOCAL * LOCAL];\n"
+    "  __local int x0[LOCAL * LOCAL], y0[LOCAL * LOCAL];\n"
+    "  __local int x1[LOCAL * LOCAL], y1[LOCAL * LOCAL];\n"
+    "  int lx = get_local_id(0), ly = get_local_id(1);\n"
+    "  int lid = ly * LOCAL + lx;\n"
+    "  int tx = get_group_id(0), ty = get_group_id(1);\n"
+    "  uint nbad = 0, m = 0, s = 0;\n"
+    "  int bx0 = width, by0 = height, bx1 = -1, by1 = -1;\n"
+    "  uint4 t = convert_uint4(tol);\n"
+    "  for (int y = ty * TILE + ly; y < min(ty * TILE + TILE, height);\n"
+    "       y += LOCAL) {\n"
+    "    for (int x = tx * TILE + lx; x < min(tx * TILE + TILE, width);\n"
+    "         x += LOCAL) {\n"
+    "      int i = y * width + x;\n"
+    "      uint4 d = abs(convert_int4(a[i]) - convert_int4(b[i]));\n"
+    "      m = max(m, max(max(d.x, d.y), max(d.z, d.w)));\n"
+    "      s += d.x * d.x + d.y * d.y + d.z * d.z + d.w * d.w;\n"
+    "      if (any(d > t)) {\n"
+    "        nbad++;\n"
+    "        bx0 = min(bx0, x); by0 = min(by0, y);\n"
+    "        bx1 = max(bx1, x); by1 = max(by1, y);\n"
+    "      }\n"
+    "    }\n"
+    "  }\n"
+    "  bad[lid] = nbad; maxd[lid] = m; sse[lid] = s;\n"
+    "  x0[lid] = bx0; y0[lid] = by0; x1[lid] = bx1; y1[lid] = by1;\n"
+    "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  for (int n = LOCAL * LOCAL / 2; n > 0; n /= 2) {\n"
+    "    if (lid < n) {\n"
+    "      bad[lid] += bad[lid + n];\n"
+    "      maxd[lid] = max(maxd[lid], maxd[lid + n]);\n"
+    "      sse[lid] += sse[lid + n];\n"
+    "      x0[lid] = min(x0[lid], x0[lid + n]);\n"
+    "      y0[lid] = min(y0[lid], y0[lid + n]);\n"
+    "      x1[lid] = max(x1[lid], x1[lid + n]);\n"
+    "      y1[lid] = max(y1[lid], y1[lid + n]);\n"
+    "    }\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  }\n"
+    "  if (lid == 0) {\n"
+    "    __global uint *p = partials +\n"
+    "        (ty * get_num_groups(0) + tx) * WORDS;\n"
+    "    p[0] = bad[0]; p[1] = maxd[0]; p[2] = sse[0];\n"
+    "    p[3] = x0[0]; p[4] = y0[0]; p[5] = x1[0]; p[6] = y1[0];\n"
+    "  }\n"
+    "}\n";
+
+static struct {
+  cl_context ctx;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem a, b, partials;
+  int width, height, tile_size, tiles_x, tiles_y;
+  size_t local;
+  uint32_t *results;
+  char device_name[128];
+} cl;
+
+/* Find a device of the requested type on any platform */
+static cl_device_id find_device(enum cl_compare_device type)
+{
+  cl_platform_id platforms[MAX_PLATFORMS];
+  cl_device_id device;
+  cl_uint num_platforms, i;
+  int pass;
+
+  if (clGetPlatformIDs(MAX_PLATFORMS, platforms, &num_platforms) != CL_SUCCESS)
+    return NULL;
+
+  /* For "any", look for a GPU first and then for a CPU */
+  for (pass = 0; pass < 2; pass++) {
+    cl_device_type want;
+    if (type == CL_COMPARE_GPU || (type == CL_COMPARE_ANY && pass == 0))
+      want = CL_DEVICE_TYPE_GPU;
+    else
+      want = CL_DEVICE_TYPE_CPU;
+    if (pass == 1 && type != CL_COMPARE_ANY)
+      break;
+
+    for (i = 0; i < num_platforms; i++) {
+      if (clGetDeviceIDs(platforms[i], want, 1, &device, NULL) == CL_SUCCESS)
+        return device;
+    }
+  }
+  return NULL;
+}
+
+bool ClCompareInit(enum cl_compare_device type, int width, int height,
+                   int tile_size)
+{
+  size_t frame = (size_t) width * height * 4;
+  size_t max_group;
+  cl_device_id device;
+  cl_int err;
+  char options[96];
+  int tiles;
+
+  ClCompareRelease();
+
+  device = find_device(type);
+  if (!device) {
+    fprintf(stderr, "no OpenCL device found, comparing on the CPU\n");
+    return false;
+  }
+  clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(cl.device_name),
+                  cl.device_name, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group),
+                  &max_group, NULL);
+  /* 16x16 work groups where possible, smaller GPUs get 8x8 */
+  cl.local = max_group >= 256 ? 16 : 8;
+  if (cl.local > tile_size)
+    cl.local = tile_size;
+
+  cl.width = width;
+  cl.height = height;
+  cl.tile_size = tile_size;
+  cl.tiles_x = (width + tile_size - 1) / tile_size;
+  cl.tiles_y = (height + tile_size - 1) / tile_size;
+  tiles = cl.tiles_x * cl.tiles_y;
+
+  cl.ctx = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+    goto fail;
+  cl.queue = clCreateCommandQueue(cl.ctx, device, 0, &err);
+  if (err != CL_SUCCESS)
+    goto fail;
+
+  cl.program = clCreateProgramWithSource(cl.ctx, 1, &kDiffKernel, NULL, &err);
+  if (err != CL_SUCCESS)
+    goto fail;
+  snprintf(options, sizeof(options), "-DLOCAL=%zu -DTILE=%d -DWORDS=%d",
+           cl.local, tile_size, PARTIAL_WORDS);
+  if (clBuildProgram(cl.program, 1, &device, options, NULL, NULL) !=
+      CL_SUCCESS) {
+    char log[2048] = "";
+    clGetProgramBuildInfo(cl.program, device, CL_PROGRAM_BUILD_LOG,
+                          sizeof(log), log, NULL);
+    fprintf(stderr, "OpenCL diff kernel failed to build:\n%s\n", log);
+    goto fail;
+  }
+  cl.kernel = clCreateKernel(cl.program, "diff_tiles", &err);
+  if (err != CL_SUCCESS)
+    goto fail;
+
+  cl.a = clCreateBuffer(cl.ctx, CL_MEM_READ_ONLY, frame, NULL, &err);
+  if (err != CL_SUCCESS)
+    goto fail;
+  cl.b = clCreateBuffer(cl.ctx, CL_MEM_READ_ONLY, frame, NULL, &err);
+  if (err != CL_SUCCESS)
+    goto fail;
+  cl.partials = clCreateBuffer(cl.ctx, CL_MEM_WRITE_ONLY,
+                               tiles * PARTIAL_WORDS * sizeof(cl_uint),
+                               NULL, &err);
+  if (err != CL_SUCCESS)
+    goto fail;
+  cl.results = malloc(tiles * PARTIAL_WORDS * sizeof(uint32_t));
+
+  clSetKernelArg(cl.kernel, 0, sizeof(cl_mem), &cl.a);
+  clSetKernelArg(cl.kernel, 1, sizeof(cl_mem), &cl.b);
+  clSetKernelArg(cl.kernel, 2, sizeof(int), &cl.width);
+  clSetKernelArg(cl.kernel, 3, sizeof(int), &cl.height);
+  clSetKernelArg(cl.kernel, 5, sizeof(cl_mem), &cl.partials);
+  return true;
+
+fail:
+  fprintf(stderr, "OpenCL setup on %s failed, comparing on the CPU\n",
+          cl.device_name);
+  ClCompareRelease();
+  return false;
+}
+
+const char *ClCompareDevice(void)
+{
+  return cl.device_name;
+}
+
+int ClCompareTiles(const uint8_t *a, const uint8_t *b,
+                   const uint8_t tolerance[4], struct img_diff *tiles)
+{
+  size_t frame = (size_t) cl.width * cl.height * 4;
+  size_t global[2] = { cl.tiles_x * cl.local, cl.tiles_y * cl.local };
+  size_t local[2] = { cl.local, cl.local };
+  int count = cl.tiles_x * cl.tiles_y;
+
+  if (!cl.kernel)
+    return -1;
+
+  clSetKernelArg(cl.kernel, 4, 4, tolerance);
+  if (clEnqueueWriteBuffer(cl.queue, cl.a, CL_FALSE, 0, frame, a,
+                           0, NULL, NULL) != CL_SUCCESS ||
+      clEnqueueWriteBuffer(cl.queue, cl.b, CL_FALSE, 0, frame, b,
+                           0, NULL, NULL) != CL_SUCCESS ||
+      clEnqueueNDRangeKernel(cl.queue, cl.kernel, 2, NULL, global, local,
+                             0, NULL, NULL) != CL_SUCCESS ||
+      clEnqueueReadBuffer(cl.queue, cl.partials, CL_TRUE, 0,
+                          count * PARTIAL_WORDS * sizeof(uint32_t),
+                          cl.results, 0, NULL, NULL) != CL_SUCCESS) {
+    fprintf(stderr, "OpenCL diff on %s failed\n", cl.device_name);
+    ClCompareRelease();
+    return -1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const uint32_t *p = cl.results + i * PARTIAL_WORDS;
+    memset(&tiles[i], 0, sizeof(tiles[i]));
+    tiles[i].bad_pixels = p[0];
+    tiles[i].max_delta = p[1];
+    tiles[i].sse = p[2];
+    tiles[i].x0 = (int32_t) p[3];
+    tiles[i].y0 = (int32_t) p[4];
+    tiles[i].x1 = (int32_t) p[5];
+    tiles[i].y1 = (int32_t) p[6];
+  }
+  return 0;
+}
+
+void ClCompareRelease(void)
+{
+  if (cl.partials)
+    clReleaseMemObject(cl.partials);
+  if (cl.b)
+    clReleaseMemObject(cl.b);
+  if (cl.a)
+    clReleaseMemObject(cl.a);
+  if (cl.kernel)
+    clReleaseKernel(cl.kernel);
+  if (cl.program)
+    clReleaseProgram(cl.program);
+  if (cl.queue)
+    clReleaseCommandQueue(cl.queue);
+  if (cl.ctx)
+    clReleaseContext(cl.ctx);
+  free(cl.results);
+  memset(&cl, 0, sizeof(cl));
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CLCOMPARE_H
+#define CLCOMPARE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "imgcompare.h"
+
+enum cl_compare_device {
+  CL_COMPARE_ANY,   /* first GPU, else first CPU device */
+  CL_COMPARE_GPU,
+  CL_COMPARE_CPU,
+};
+
+/*
+ * Set up golden comparison on an OpenCL device for width x height frames
+ * split into tile_size tiles. Returns false when OpenCL support is not
+ * built in or no matching device exists; callers then stay on the CPU.
+ */
+bool ClCompareInit(enum cl_compare_device type, int width, int height,
+                   int tile_size);
+
+/* Name of the device in use, for reports */
+const char *ClCompareDevice(void);
+
+/*
+ * Diff two RGBA8 frames on the device. tiles[] receives one img_diff per
+ * tile in row-major order (psnr is left unset). Returns -1 if the device
+ * failed, in which case ClCompareInit() has to be called again.
+ */
+int ClCompareTiles(const uint8_t *a, const uint8_t *b,
+                   const uint8_t tolerance[4], struct img_diff *tiles);
+
+void ClCompareRelease(void);
+
+#endif
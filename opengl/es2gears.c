@@ -51,7 +51,18 @@
 #include <string.h>
 #include <unistd.h>
 
-extern void HandleFrame(void);
+#include "perfcount.h"
+#include "scenesetup.h"
+#include "startup.h"
+
+extern void BeginFrame(void);
+extern int HandleFrame(void);
+extern void GetFrameSize(int *width, int *height);
+extern double AnimationTime(void);
+extern int SoakRecycle(void);
+
+/* CPU counters for building the gear geometry, with -perf */
+static struct perf_phase geometry = { .name = "geometry" };
 
 #define STRIPS_PER_TOOTH 7
 #define VERTICES_PER_TOOTH 34
@@ -88,17 +99,23 @@ struct gear {
 
 /** The view rotation [x, y, z] */
 static GLfloat view_rot[3] = { 20.0, 30.0, 0.0 };
+/*
+ * The scene state below is per thread, with -contexts every render thread
+ * draws its own copy of the scene in its own context.
+ */
 /** The gears */
-static struct gear *gear1, *gear2, *gear3;
+static __thread struct gear *gear1, *gear2, *gear3;
+/** The shader program drawing the gears */
+static __thread GLuint program;
 /** The current gear rotation angle */
-static GLfloat angle = 0.0;
+static __thread GLfloat angle = 0.0;
 /** The location of the shader uniforms */
-static GLuint ModelViewProjectionMatrix_location,
-              NormalMatrix_location,
-              LightSourcePosition_location,
-              MaterialColor_location;
+static __thread GLuint ModelViewProjectionMatrix_location,
+                       NormalMatrix_location,
+                       LightSourcePosition_location,
+                       MaterialColor_location;
 /** The projection matrix */
-static GLfloat ProjectionMatrix[16];
+static __thread GLfloat ProjectionMatrix[16];
 /** The direction of the directional light for the scene */
 static const GLfloat LightSourcePosition[4] = { 5.0, 5.0, 10.0, 1.0};
 
@@ -269,15 +286,42 @@ create_gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
 
    gear->nvertices = (v - gear->vertices);
 
-   /* Store the vertices in a vertex buffer object (VBO) */
-   glGenBuffers(1, &gear->vbo);
-   glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
-   glBufferData(GL_ARRAY_BUFFER, gear->nvertices * sizeof(GearVertex),
-         gear->vertices, GL_STATIC_DRAW);
+   /* Store the vertices in a vertex buffer object (VBO), on the loader */
+   SceneSetupUpload(&gear->vbo, gear->vertices,
+         gear->nvertices * sizeof(GearVertex));
 
    return gear;
 }
 
+/**
+ * Frees the CPU copy of a gear's vertices, once they are in the VBO.
+ *
+ * @param gear the gear, may be NULL
+ */
+static void
+free_vertices(struct gear *gear)
+{
+   if (gear == NULL)
+      return;
+   free(gear->vertices);
+   gear->vertices = NULL;
+}
+
+/**
+ * Frees a gear and its vertex buffer object.
+ *
+ * @param gear the gear to free, may be NULL
+ */
+static void
+destroy_gear(struct gear *gear)
+{
+   if (gear == NULL)
+      return;
+   glDeleteBuffers(1, &gear->vbo);
+   free(gear->strips);
+   free(gear);
+}
+
 /**
  * Multiplies two 4x4 matrices.
  *
@@ -592,36 +636,39 @@ static const char fragment_shader[] =
 static void
 gears_init(void)
 {
-   GLuint v, f, program;
-   const char *p;
-   char msg[512];
+   static const char *const attribs[] = { "position", "normal", NULL };
+   /* Soak recycling runs this again, only the first build is reported */
+   static int init_reported;
 
    glEnable(GL_CULL_FACE);
    glEnable(GL_DEPTH_TEST);
 
-   /* Compile the vertex shader */
-   p = vertex_shader;
-   v = glCreateShader(GL_VERTEX_SHADER);
-   glShaderSource(v, 1, &p, NULL);
-   glCompileShader(v);
-   glGetShaderInfoLog(v, sizeof msg, NULL, msg);
-
-   /* Compile the fragment shader */
-   p = fragment_shader;
-   f = glCreateShader(GL_FRAGMENT_SHADER);
-   glShaderSource(f, 1, &p, NULL);
-   glCompileShader(f);
-   glGetShaderInfoLog(f, sizeof msg, NULL, msg);
-
-   /* Create and link the shader program */
-   program = glCreateProgram();
-   glAttachShader(program, v);
-   glAttachShader(program, f);
-   glBindAttribLocation(program, 0, "position");
-   glBindAttribLocation(program, 1, "normal");
-
-   glLinkProgram(program);
-   glGetProgramInfoLog(program, sizeof msg, NULL, msg);
+   /*
+    * The program compiles (or comes from the program cache) while the
+    * gears are built, their VBOs are uploaded by the loader thread.
+    */
+   SceneSetupBegin();
+   SceneSetupProgram(&program, vertex_shader, fragment_shader, attribs);
+
+   /* make the gears */
+   StartupBegin("geometry");
+   PerfBegin(&geometry);
+   gear1 = create_gear(1.0, 4.0, 1.0, 20, 0.7);
+   gear2 = create_gear(0.5, 2.0, 2.0, 10, 0.7);
+   gear3 = create_gear(1.3, 2.0, 0.5, 10, 0.7);
+   PerfEnd(&geometry);
+   StartupEnd("geometry");
+
+   SceneSetupFinish();
+   if (!init_reported) {
+      PerfReport("init", &geometry, 1, NULL);
+      init_reported = 1;
+   }
+
+   /* Only the VBOs are drawn from, the CPU copies are not needed anymore */
+   free_vertices(gear1);
+   free_vertices(gear2);
+   free_vertices(gear3);
 
    /* Enable the shaders */
    glUseProgram(program);
@@ -634,25 +681,39 @@ gears_init(void)
 
    /* Set the LightSourcePosition uniform which is constant throught the program */
    glUniform4fv(LightSourcePosition_location, 1, LightSourcePosition);
+}
 
-   /* make the gears */
-   gear1 = create_gear(1.0, 4.0, 1.0, 20, 0.7);
-   gear2 = create_gear(0.5, 2.0, 2.0, 10, 0.7);
-   gear3 = create_gear(1.3, 2.0, 0.5, 10, 0.7);
+static void
+gears_fini(void)
+{
+   destroy_gear(gear1);
+   destroy_gear(gear2);
+   destroy_gear(gear3);
+   gear1 = gear2 = gear3 = NULL;
+   glUseProgram(0);
+   glDeleteProgram(program);
+   program = 0;
 }
 
 void RunGears() {
-  gears_init();
-  gears_reshape(600, 600);
-  while (1) {
-    double dt = 0.01666;
-
-    /* advance rotation for next frame */
-    angle += 70.0 * dt;  /* 70 degrees per second */
-    if (angle > 3600.0)
-      angle -= 3600.0;
+  int width, height;
 
+  GetFrameSize(&width, &height);
+  gears_init();
+  gears_reshape(width, height);
+  do {
+    /* Soak runs rebuild everything now and then to expose leaks */
+    if (SoakRecycle()) {
+      gears_fini();
+      gears_init();
+      gears_reshape(width, height);
+    }
+
+    /* rotation for the current animation time */
+    angle = fmod(70.0 * AnimationTime(), 3600.0);  /* 70 degrees per second */
+
+    BeginFrame();
     gears_draw();
-    HandleFrame();
-  }
+  } while (HandleFrame());
+  gears_fini();
 }
@@ -0,0 +1,312 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * GPU golden comparison. The frame is blitted into a texture and a
+ * full-screen pass over a tiles_x x tiles_y integer render target diffs
+ * it against the golden texture, one fragment per tile. Fragments of
+ * identical tiles are discarded, so an occlusion query tells whether the
+ * frame matched at all; only when it did not are the per-tile results,
+ * 16 bytes per tile, needed on the CPU.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "glcompare.h"
+
+/* uints per tile in the result target */
+#define RESULT_WORDS 4
+
+static const char *kVertexShader =
+    "#version 300 es\n"
+    "void main() {\n"
+    "  // One triangle covering the whole viewport\n"
+    "  gl_Position = vec4(gl_VertexID == 1 ? 3.0 : -1.0,\n"
+    "                     gl_VertexID == 2 ? 3.0 : -1.0, 0.0, 1.0);\n"
+    "}\n";
+
+/*
+ * TILE comes in as a define. The result is bad pixel count, max delta, sum
+ * of squares and the tile relative bounding box packed into 8-bit fields.
+ */
+static const char *kDiffShader =
+    "precision highp float;\n"
+    "precision highp int;\n"
+    "uniform highp sampler2D golden;\n"
+    "uniform highp sampler2D frame;\n"
+    "uniform uvec4 tolerance;\n"
+    "uniform ivec2 size;\n"
+    "layout(location = 0) out uvec4 result;\n"
+    "void main() {\n"
+    "  ivec2 origin = ivec2(gl_FragCoord.xy) * TILE;\n"
+    "  ivec2 end = min(origin + TILE, size) - origin;\n"
+    "  ivec2 lo = ivec2(TILE), hi = ivec2(0);\n"
+    "  uint bad = 0u, m = 0u, s = 0u;\n"
+    "  for (int y = 0; y < end.y; y++) {\n"
+    "    for (int x = 0; x < end.x; x++) {\n"
+    "      ivec2 p = origin + ivec2(x, y);\n"
+    "      ivec4 a = ivec4(texelFetch(golden, p, 0) * 255.0 + 0.5);\n"
+    "      ivec4 b = ivec4(texelFetch(frame, p, 0) * 255.0 + 0.5);\n"
+    "      uvec4 d = uvec4(abs(a - b));\n"
+    "      m = max(m, max(max(d.r, d.g), max(d.b, d.a)));\n"
+    "      s += d.r * d.r + d.g * d.g + d.b * d.b + d.a * d.a;\n"
+    "      if (any(greaterThan(d, tolerance))) {\n"
+    "        bad++;\n"
+    "        lo = min(lo, ivec2(x, y));\n"
+    "        hi = max(hi, ivec2(x, y));\n"
+    "      }\n"
+    "    }\n"
+    "  }\n"
+    "  if (m == 0u)\n"
+    "    discard;\n"
+    "  result = uvec4(bad, m, s, uint(lo.x) | uint(lo.y) << 8 |\n"
+    "                 uint(hi.x) << 16 | uint(hi.y) << 24);\n"
+    "}\n";
+
+static struct {
+  GLuint program, vertex, fragment;
+  GLuint golden[2], frame;
+  GLuint frame_fbo, result_fbo, result_rb;
+  GLint tolerance_location;
+  int width, height, tile_size, tiles_x, tiles_y;
+  int current;   /* golden texture the next diff uses */
+} gl;
+
+static GLuint compile_shader(GLenum type, const char *const *source,
+                             int count)
+{
+  GLuint shader = glCreateShader(type);
+  GLint ok;
+
+  glShaderSource(shader, count, source, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024] = "";
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "GPU diff shader failed to compile:\n%s\n", log);
+  }
+  return shader;
+}
+
+static GLuint create_texture(GLenum format, int width, int height)
+{
+  GLuint texture;
+
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  return texture;
+}
+
+bool GlCompareInit(int width, int height, int tile_size)
+{
+  const char *version = (const char *) glGetString(GL_VERSION);
+  const char *fragment[3];
+  char defines[64];
+  GLint ok, scene_fbo;
+
+  GlCompareRelease();
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &scene_fbo);
+  if (!version || strncmp(version, "OpenGL ES 3", 11) != 0) {
+    fprintf(stderr, "GPU compare needs OpenGL ES 3, comparing on the CPU\n");
+    return false;
+  }
+
+  gl.width = width;
+  gl.height = height;
+  gl.tile_size = tile_size;
+  gl.tiles_x = (width + tile_size - 1) / tile_size;
+  gl.tiles_y = (height + tile_size - 1) / tile_size;
+
+  snprintf(defines, sizeof(defines), "#version 300 es\n#define TILE %d\n",
+           tile_size);
+  fragment[0] = defines;
+  fragment[1] = kDiffShader;
+  gl.vertex = compile_shader(GL_VERTEX_SHADER, &kVertexShader, 1);
+  gl.fragment = compile_shader(GL_FRAGMENT_SHADER, fragment, 2);
+  gl.program = glCreateProgram();
+  glAttachShader(gl.program, gl.vertex);
+  glAttachShader(gl.program, gl.fragment);
+  glLinkProgram(gl.program);
+  glGetProgramiv(gl.program, GL_LINK_STATUS, &ok);
+  if (!ok)
+    goto fail;
+
+  glUseProgram(gl.program);
+  glUniform1i(glGetUniformLocation(gl.program, "golden"), 0);
+  glUniform1i(glGetUniformLocation(gl.program, "frame"), 1);
+  glUniform2i(glGetUniformLocation(gl.program, "size"), width, height);
+  gl.tolerance_location = glGetUniformLocation(gl.program, "tolerance");
+  glUseProgram(0);
+
+  gl.golden[0] = create_texture(GL_RGBA8, width, height);
+  gl.golden[1] = create_texture(GL_RGBA8, width, height);
+  gl.frame = create_texture(GL_RGBA8, width, height);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glGenFramebuffers(1, &gl.frame_fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, gl.frame_fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         gl.frame, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    goto fail;
+
+  glGenRenderbuffers(1, &gl.result_rb);
+  glBindRenderbuffer(GL_RENDERBUFFER, gl.result_rb);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA32UI, gl.tiles_x,
+                        gl.tiles_y);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  glGenFramebuffers(1, &gl.result_fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, gl.result_fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, gl.result_rb);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    goto fail;
+  glBindFramebuffer(GL_FRAMEBUFFER, scene_fbo);
+  return true;
+
+fail:
+  fprintf(stderr, "GPU compare setup failed, comparing on the CPU\n");
+  glBindFramebuffer(GL_FRAMEBUFFER, scene_fbo);
+  GlCompareRelease();
+  return false;
+}
+
+void GlCompareSetGolden(const uint8_t *pixels)
+{
+  GLint texture;
+
+  gl.current ^= 1;
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &texture);
+  glBindTexture(GL_TEXTURE_2D, gl.golden[gl.current]);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, gl.width, gl.height, GL_RGBA,
+                  GL_UNSIGNED_BYTE, pixels);
+  glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+void GlCompareFrame(GLuint query, GLuint pbo, const uint8_t tolerance[4])
+{
+  static const GLuint zero[4];
+  GLint program, viewport[4], active_texture, textures[2], scene_fbo;
+  GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+  GLboolean cull_face = glIsEnabled(GL_CULL_FACE);
+  GLboolean blend = glIsEnabled(GL_BLEND);
+  int i;
+
+  glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glGetIntegerv(GL_ACTIVE_TEXTURE, &active_texture);
+
+  // Copy the back buffer, converting to RGBA8 whatever its format.
+  // Headless runs draw into an FBO instead of the default framebuffer.
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &scene_fbo);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, scene_fbo);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, gl.frame_fbo);
+  glBlitFramebuffer(0, 0, gl.width, gl.height, 0, 0, gl.width, gl.height,
+                    GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, gl.result_fbo);
+  glViewport(0, 0, gl.tiles_x, gl.tiles_y);
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_CULL_FACE);
+  glDisable(GL_BLEND);
+  glClearBufferuiv(GL_COLOR, 0, zero);
+
+  glUseProgram(gl.program);
+  glUniform4ui(gl.tolerance_location, tolerance[0], tolerance[1],
+               tolerance[2], tolerance[3]);
+  for (i = 0; i < 2; i++) {
+    glActiveTexture(GL_TEXTURE0 + i);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &textures[i]);
+    glBindTexture(GL_TEXTURE_2D, i ? gl.frame : gl.golden[gl.current]);
+  }
+
+  glBeginQuery(GL_ANY_SAMPLES_PASSED, query);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glEndQuery(GL_ANY_SAMPLES_PASSED);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  glReadPixels(0, 0, gl.tiles_x, gl.tiles_y, GL_RGBA_INTEGER,
+               GL_UNSIGNED_INT, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  for (i = 0; i < 2; i++) {
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+  }
+  glActiveTexture(active_texture);
+  glUseProgram(program);
+  glBindFramebuffer(GL_FRAMEBUFFER, scene_fbo);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  if (depth_test)
+    glEnable(GL_DEPTH_TEST);
+  if (cull_face)
+    glEnable(GL_CULL_FACE);
+  if (blend)
+    glEnable(GL_BLEND);
+}
+
+size_t GlCompareResultSize(void)
+{
+  return (size_t) gl.tiles_x * gl.tiles_y * RESULT_WORDS * sizeof(GLuint);
+}
+
+void GlCompareTile(const void *results, int i, int x, int y,
+                   struct img_diff *tile)
+{
+  const GLuint *p = (const GLuint *) results + i * RESULT_WORDS;
+
+  memset(tile, 0, sizeof(*tile));
+  tile->bad_pixels = p[0];
+  tile->max_delta = p[1];
+  tile->sse = p[2];
+  tile->x0 = x + (p[3] & 0xff);
+  tile->y0 = y + (p[3] >> 8 & 0xff);
+  tile->x1 = x + (p[3] >> 16 & 0xff);
+  tile->y1 = y + (p[3] >> 24);
+}
+
+void GlCompareRelease(void)
+{
+  if (gl.result_fbo)
+    glDeleteFramebuffers(1, &gl.result_fbo);
+  if (gl.frame_fbo)
+    glDeleteFramebuffers(1, &gl.frame_fbo);
+  if (gl.result_rb)
+    glDeleteRenderbuffers(1, &gl.result_rb);
+  if (gl.frame)
+    glDeleteTextures(1, &gl.frame);
+  if (gl.golden[0])
+    glDeleteTextures(2, gl.golden);
+  if (gl.program)
+    glDeleteProgram(gl.program);
+  if (gl.fragment)
+    glDeleteShader(gl.fragment);
+  if (gl.vertex)
+    glDeleteShader(gl.vertex);
+  memset(&gl, 0, sizeof(gl));
+}
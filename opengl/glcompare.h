@@ -0,0 +1,68 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GLCOMPARE_H
+#define GLCOMPARE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <GLES3/gl3.h>
+
+#include "imgcompare.h"
+
+/*
+ * Set up golden comparison on the GPU for width x height frames split into
+ * tile_size tiles. Needs an OpenGL ES 3 context; returns false otherwise,
+ * callers then stay on the CPU.
+ */
+bool GlCompareInit(int width, int height, int tile_size);
+
+/*
+ * Upload the golden RGBA8 frame (as read by glReadPixels) the next
+ * GlCompareFrame() diffs against. Two textures alternate, so the upload
+ * for the next checkpoint does not wait for the pending diff pass.
+ */
+void GlCompareSetGolden(const uint8_t *pixels);
+
+/*
+ * Diff the back buffer against the current golden texture. Tiles with any
+ * differing pixel pass the GL_ANY_SAMPLES_PASSED query, and the per-tile
+ * results are read into the pixel pack buffer pbo, which must hold
+ * GlCompareResultSize() bytes. GL state touched by the pass is restored.
+ */
+void GlCompareFrame(GLuint query, GLuint pbo, const uint8_t tolerance[4]);
+
+size_t GlCompareResultSize(void);
+
+/*
+ * Decode the result of tile i, whose top left pixel is (x, y), from a
+ * mapped result buffer (psnr is left unset).
+ */
+void GlCompareTile(const void *results, int i, int x, int y,
+                   struct img_diff *tile);
+
+void GlCompareRelease(void);
+
+#endif
@@ -34,7 +34,17 @@
 #include <string.h>
 #include <unistd.h>
 
-extern void HandleFrame(void);
+#include "perfcount.h"
+#include "startup.h"
+
+extern void BeginFrame(void);
+extern int HandleFrame(void);
+extern void GetFrameSize(int *width, int *height);
+extern double AnimationTime(void);
+extern int SoakRecycle(void);
+
+/* CPU counters for building the gear geometry, with -perf */
+static struct perf_phase geometry = { .name = "geometry" };
 
 #ifndef M_PI
 #define M_PI 3.14159265
@@ -237,6 +247,15 @@ gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
   return gear;
 }
 
+static void
+free_gear(gear_t *gear)
+{
+  if (!gear)
+    return;
+  free(gear->vertices);
+  free(gear->indices);
+  free(gear);
+}
 
 void draw_gear(gear_t* gear) {
   glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, gear->color);
@@ -247,8 +266,9 @@ void draw_gear(gear_t* gear) {
 }
 
 static GLfloat view_rotx = 20.0, view_roty = 30.0, view_rotz = 0.0;
-static gear_t *gear1, *gear2, *gear3;
-static GLfloat angle = 0.0;
+/* Per thread, with -contexts every render thread draws its own scene */
+static __thread gear_t *gear1, *gear2, *gear3;
+static __thread GLfloat angle = 0.0;
 
 static void
 draw(void)
@@ -307,6 +327,8 @@ void initialize() {
   static GLfloat red[4] = {0.8, 0.1, 0.0, 1.0};
   static GLfloat green[4] = {0.0, 0.8, 0.2, 1.0};
   static GLfloat blue[4] = {0.2, 0.2, 1.0, 1.0};
+  /* Soak recycling runs this again, only the first build is reported */
+  static int init_reported;
 
   glLightfv(GL_LIGHT0, GL_POSITION, pos);
   glEnable(GL_CULL_FACE);
@@ -315,26 +337,48 @@ void initialize() {
   glEnable(GL_DEPTH_TEST);
 
   /* make the gears */
+  StartupBegin("geometry");
+  PerfBegin(&geometry);
   gear1 = gear(1.0, 4.0, 1.0, 20, 0.7, red);
   gear2 = gear(0.5, 2.0, 2.0, 10, 0.7, green);
   gear3 = gear(1.3, 2.0, 0.5, 10, 0.7, blue);
+  PerfEnd(&geometry);
+  StartupEnd("geometry");
+  if (!init_reported) {
+    PerfReport("init", &geometry, 1, NULL);
+    init_reported = 1;
+  }
+}
+
+static void
+finalize(void)
+{
+  free_gear(gear1);
+  free_gear(gear2);
+  free_gear(gear3);
+  gear1 = gear2 = gear3 = NULL;
 }
 
 void RunGears() {
-  double dt = 0.01666;
+  int width, height;
 
+  GetFrameSize(&width, &height);
   initialize();
-  reshape(600, 600);
-
-  while (1) {
-    dt = 0.01666;
+  reshape(width, height);
+
+  do {
+    /* Soak runs rebuild everything now and then to expose leaks */
+    if (SoakRecycle()) {
+      finalize();
+      initialize();
+      reshape(width, height);
+    }
 
-    /* advance rotation for next frame */
-    angle += 70.0 * dt;  /* 70 degrees per second */
-    if (angle > 3600.0)
-      angle -= 3600.0;
+    /* rotation for the current animation time */
+    angle = fmod(70.0 * AnimationTime(), 3600.0);  /* 70 degrees per second */
 
+    BeginFrame();
     draw();
-    HandleFrame();
-  }
+  } while (HandleFrame());
+  finalize();
 }
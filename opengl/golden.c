@@ -0,0 +1,575 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "golden.h"
+#include "hash.h"
+
+struct golden_archive {
+  const uint8_t *base;
+  size_t size;
+  const struct golden_header *header;
+  const struct golden_entry *index;
+  uint8_t *frame;
+  bool own_frame;
+  int decoded;  /* checkpoint currently in frame, -1 if none */
+};
+
+/* Frames queued for the writer thread before GoldenWriterAdd() waits */
+#define GOLDEN_WRITER_POOL 4
+
+/*
+ * Frames are copied into a fixed pool of buffers and encoded/written on a
+ * dedicated thread, so adding a frame costs a copy and a queue push. The
+ * pool bounds both memory and how far the writer may fall behind.
+ */
+struct golden_writer {
+  char *path, *tmp_path;
+  FILE *fp;
+  struct golden_header header;
+  struct golden_entry *index;
+  int capacity;
+  uint32_t *prev, *delta;
+  uint8_t *encoded;
+  uint64_t *hashes;
+  /* One block holding all of the above and the pool */
+  void *buffers;
+  bool own_buffers;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint8_t *pool[GOLDEN_WRITER_POOL];
+  double times[GOLDEN_WRITER_POOL];
+  /* Filled buffers are pool[head .. head + queued), the rest are free */
+  int head, queued;
+  bool closing;
+  bool error;
+};
+
+/*
+ * Run-length encoding on 32-bit pixels. A control byte c < 128 is followed
+ * by c + 1 literal pixels, c >= 128 by a single pixel repeated c - 126
+ * times.
+ */
+#define RLE_MAX_RUN 129
+#define RLE_MAX_LITERAL 128
+
+int GoldenTileCount(int width, int height, int tile_size)
+{
+  return ((width + tile_size - 1) / tile_size) *
+         ((height + tile_size - 1) / tile_size);
+}
+
+void GoldenTileHashes(const uint8_t *pixels, int width, int height,
+                      int tile_size, uint64_t *hashes)
+{
+  int tiles_x = (width + tile_size - 1) / tile_size;
+
+  /* Hash a whole row of tiles at a time to walk memory linearly */
+  for (int ty = 0; ty * tile_size < height; ty++) {
+    uint64_t *row = hashes + ty * tiles_x;
+    int y1 = ty * tile_size + tile_size;
+
+    if (y1 > height)
+      y1 = height;
+    for (int tx = 0; tx < tiles_x; tx++)
+      row[tx] = 0;
+    for (int y = ty * tile_size; y < y1; y++) {
+      const uint8_t *line = pixels + (size_t) y * width * 4;
+      for (int tx = 0; tx < tiles_x; tx++) {
+        int x0 = tx * tile_size;
+        int w = width - x0 < tile_size ? width - x0 : tile_size;
+        row[tx] = Hash64(line + x0 * 4, w * 4, row[tx]);
+      }
+    }
+  }
+}
+
+static size_t rle_bound(size_t pixels)
+{
+  return pixels * 4 + pixels / RLE_MAX_LITERAL + 1;
+}
+
+/* Writer buffers are carved out at cache line boundaries */
+static size_t align64(size_t size)
+{
+  return (size + 63) & ~(size_t) 63;
+}
+
+size_t GoldenWriterBufferSize(int width, int height)
+{
+  size_t pixels = (size_t) width * height;
+
+  return align64(GoldenTileCount(width, height, GOLDEN_TILE_SIZE) *
+                 sizeof(uint64_t)) +
+         (2 + GOLDEN_WRITER_POOL) * align64(pixels * 4) +
+         align64(rle_bound(pixels));
+}
+
+static size_t rle_encode(const uint32_t *src, size_t pixels, uint8_t *dst)
+{
+  uint8_t *out = dst;
+  size_t i = 0;
+
+  while (i < pixels) {
+    size_t run = 1;
+    while (i + run < pixels && run < RLE_MAX_RUN && src[i + run] == src[i])
+      run++;
+    if (run >= 2) {
+      *out++ = run + 126;
+      memcpy(out, &src[i], 4);
+      out += 4;
+      i += run;
+      continue;
+    }
+
+    /* Literal run up to the next pair of equal pixels */
+    size_t lit = 1;
+    while (i + lit < pixels && lit < RLE_MAX_LITERAL &&
+           !(i + lit + 1 < pixels && src[i + lit] == src[i + lit + 1]))
+      lit++;
+    *out++ = lit - 1;
+    memcpy(out, &src[i], lit * 4);
+    out += lit * 4;
+    i += lit;
+  }
+  return out - dst;
+}
+
+/* Decode into dst, XORing onto its contents for delta frames */
+static int rle_decode(const uint8_t *src, size_t size, uint32_t *dst,
+                      size_t pixels, int delta)
+{
+  const uint8_t *end = src + size;
+  size_t i = 0;
+
+  while (src < end && i < pixels) {
+    unsigned c = *src++;
+    size_t n = c < 128 ? c + 1 : c - 126;
+    uint32_t v;
+
+    if (i + n > pixels || src + (c < 128 ? n * 4 : 4) > end)
+      return -1;
+    for (size_t k = 0; k < n; k++) {
+      memcpy(&v, src + (c < 128 ? k * 4 : 0), 4);
+      dst[i + k] = delta ? dst[i + k] ^ v : v;
+    }
+    src += c < 128 ? n * 4 : 4;
+    i += n;
+  }
+  return i == pixels && src == end ? 0 : -1;
+}
+
+struct golden_archive *GoldenArchiveOpen(const char *path)
+{
+  struct golden_archive *archive;
+  const struct golden_header *header;
+  struct stat st;
+  void *base;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(*header)) {
+    close(fd);
+    return NULL;
+  }
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  header = base;
+  if (memcmp(header->magic, GOLDEN_MAGIC, sizeof(GOLDEN_MAGIC)) != 0 ||
+      header->version != GOLDEN_VERSION ||
+      header->tile_size == 0 ||
+      header->frames == 0 ||
+      header->index_offset > st.st_size ||
+      (st.st_size - header->index_offset) / sizeof(struct golden_entry) <
+          header->frames) {
+    fprintf(stderr, "%s: not a golden image archive\n", path);
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  archive = calloc(1, sizeof(*archive));
+  archive->base = base;
+  archive->size = st.st_size;
+  archive->header = header;
+  archive->index = (const void *) (archive->base + header->index_offset);
+  archive->decoded = -1;
+  return archive;
+}
+
+void GoldenArchiveClose(struct golden_archive *archive)
+{
+  if (!archive)
+    return;
+  munmap((void *) archive->base, archive->size);
+  if (archive->own_frame)
+    free(archive->frame);
+  free(archive);
+}
+
+void GoldenArchiveSetFrameBuffer(struct golden_archive *archive,
+                                 uint8_t *frame)
+{
+  if (archive->own_frame)
+    free(archive->frame);
+  archive->frame = frame;
+  archive->own_frame = false;
+  archive->decoded = -1;
+}
+
+int GoldenArchiveFrames(const struct golden_archive *archive)
+{
+  return archive->header->frames;
+}
+
+void GoldenArchiveSize(const struct golden_archive *archive,
+                       int *width, int *height)
+{
+  *width = archive->header->width;
+  *height = archive->header->height;
+}
+
+int GoldenArchiveTileSize(const struct golden_archive *archive)
+{
+  return archive->header->tile_size;
+}
+
+double GoldenArchiveTime(const struct golden_archive *archive, int n)
+{
+  return archive->index[n].time;
+}
+
+const uint64_t *GoldenArchiveTileHashes(const struct golden_archive *archive,
+                                        int n)
+{
+  const struct golden_header *h = archive->header;
+  size_t size = GoldenTileCount(h->width, h->height, h->tile_size) *
+                sizeof(uint64_t);
+  const struct golden_entry *e;
+
+  if (n < 0 || n >= h->frames)
+    return NULL;
+  e = &archive->index[n];
+  if (e->hash_offset > archive->size || size > archive->size - e->hash_offset)
+    return NULL;
+  return (const uint64_t *) (archive->base + e->hash_offset);
+}
+
+const uint8_t *GoldenArchiveFrame(struct golden_archive *archive, int n)
+{
+  size_t pixels = (size_t) archive->header->width * archive->header->height;
+  int first = n;
+
+  if (n < 0 || n >= archive->header->frames)
+    return NULL;
+  if (n == archive->decoded)
+    return archive->frame;
+  if (!archive->frame) {
+    if (posix_memalign((void **) &archive->frame, 64, pixels * 4) != 0) {
+      archive->frame = NULL;
+      return NULL;
+    }
+    archive->own_frame = true;
+  }
+
+  /* Walk back to the key frame, or to the frame already decoded */
+  while (!(archive->index[first].flags & GOLDEN_KEYFRAME) &&
+         first - 1 != archive->decoded) {
+    if (first == 0)
+      return NULL;
+    first--;
+  }
+
+  for (int i = first; i <= n; i++) {
+    const struct golden_entry *e = &archive->index[i];
+
+    archive->decoded = -1;
+    if (e->offset > archive->size || e->size > archive->size - e->offset ||
+        rle_decode(archive->base + e->offset, e->size,
+                   (uint32_t *) archive->frame, pixels,
+                   !(e->flags & GOLDEN_KEYFRAME)) < 0) {
+      fprintf(stderr, "golden image archive: frame %d is corrupt\n", i);
+      return NULL;
+    }
+    archive->decoded = i;
+  }
+  return archive->frame;
+}
+
+/* Pad the file to a multiple of 8 so mapped uint64_t data is aligned */
+static void align_file(FILE *fp)
+{
+  static const uint8_t pad[8];
+  fwrite(pad, 1, -ftell(fp) & 7, fp);
+}
+
+static int write_frame(struct golden_writer *writer, const uint8_t *pixels,
+                       double time);
+
+static void *writer_thread(void *arg)
+{
+  struct golden_writer *writer = arg;
+
+  pthread_mutex_lock(&writer->lock);
+  while (1) {
+    while (writer->queued == 0 && !writer->closing)
+      pthread_cond_wait(&writer->cond, &writer->lock);
+    if (writer->queued == 0)
+      break;
+    uint8_t *frame = writer->pool[writer->head];
+    double time = writer->times[writer->head];
+    pthread_mutex_unlock(&writer->lock);
+
+    // error is only set by this thread, reading it needs no lock
+    int ret = writer->error ? -1 : write_frame(writer, frame, time);
+
+    pthread_mutex_lock(&writer->lock);
+    if (ret < 0)
+      writer->error = true;
+    writer->head = (writer->head + 1) % GOLDEN_WRITER_POOL;
+    writer->queued--;
+    pthread_cond_broadcast(&writer->cond);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+struct golden_writer *GoldenWriterOpen(const char *path,
+                                       int width, int height, void *buffers)
+{
+  struct golden_writer *writer = calloc(1, sizeof(*writer));
+  size_t pixels = (size_t) width * height;
+  uint8_t *p;
+
+  if (asprintf(&writer->tmp_path, "%s.tmp", path) < 0) {
+    free(writer);
+    return NULL;
+  }
+  writer->path = strdup(path);
+  writer->fp = fopen(writer->tmp_path, "w");
+  if (!writer->fp) {
+    perror(writer->tmp_path);
+    free(writer->tmp_path);
+    free(writer->path);
+    free(writer);
+    return NULL;
+  }
+
+  memcpy(writer->header.magic, GOLDEN_MAGIC, sizeof(GOLDEN_MAGIC));
+  writer->header.version = GOLDEN_VERSION;
+  writer->header.width = width;
+  writer->header.height = height;
+  writer->header.tile_size = GOLDEN_TILE_SIZE;
+  if (!buffers) {
+    int ret = posix_memalign(&buffers, 64,
+                             GoldenWriterBufferSize(width, height));
+    assert(ret == 0);
+    writer->own_buffers = true;
+  }
+  writer->buffers = buffers;
+  p = buffers;
+  writer->hashes = (uint64_t *) p;
+  p += align64(GoldenTileCount(width, height, GOLDEN_TILE_SIZE) *
+               sizeof(uint64_t));
+  writer->prev = (uint32_t *) p;
+  memset(writer->prev, 0, pixels * 4);
+  p += align64(pixels * 4);
+  writer->delta = (uint32_t *) p;
+  p += align64(pixels * 4);
+  writer->encoded = p;
+  p += align64(rle_bound(pixels));
+  for (int i = 0; i < GOLDEN_WRITER_POOL; i++) {
+    writer->pool[i] = p;
+    p += align64(pixels * 4);
+  }
+
+  /* Header is rewritten with the index location on close */
+  fwrite(&writer->header, sizeof(writer->header), 1, writer->fp);
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+  pthread_create(&writer->thread, NULL, writer_thread, writer);
+  return writer;
+}
+
+/* Encode and append one frame, runs on the writer thread */
+static int write_frame(struct golden_writer *writer, const uint8_t *pixels,
+                       double time)
+{
+  int tiles = GoldenTileCount(writer->header.width, writer->header.height,
+                              writer->header.tile_size);
+  size_t count = (size_t) writer->header.width * writer->header.height;
+  int n = writer->header.frames;
+  struct golden_entry *e;
+  const uint32_t *src = (const uint32_t *) pixels;
+
+  if (n == writer->capacity) {
+    writer->capacity = writer->capacity ? writer->capacity * 2 : 16;
+    writer->index = realloc(writer->index,
+                            writer->capacity * sizeof(*writer->index));
+  }
+  e = &writer->index[n];
+  e->offset = ftell(writer->fp);
+  e->flags = n % GOLDEN_KEYFRAME_INTERVAL == 0 ? GOLDEN_KEYFRAME : 0;
+  e->time = time;
+
+  if (!(e->flags & GOLDEN_KEYFRAME)) {
+    for (size_t i = 0; i < count; i++)
+      writer->delta[i] = src[i] ^ writer->prev[i];
+    src = writer->delta;
+  }
+  e->size = rle_encode(src, count, writer->encoded);
+  memcpy(writer->prev, pixels, count * 4);
+
+  if (fwrite(writer->encoded, 1, e->size, writer->fp) != e->size)
+    return -1;
+
+  GoldenTileHashes(pixels, writer->header.width, writer->header.height,
+                   writer->header.tile_size, writer->hashes);
+  align_file(writer->fp);
+  e->hash_offset = ftell(writer->fp);
+  if (fwrite(writer->hashes, sizeof(uint64_t), tiles, writer->fp) != tiles)
+    return -1;
+  writer->header.frames++;
+  return 0;
+}
+
+int GoldenWriterAdd(struct golden_writer *writer, const uint8_t *pixels,
+                    double time)
+{
+  size_t size = (size_t) writer->header.width * writer->header.height * 4;
+  bool error;
+  int slot;
+
+  pthread_mutex_lock(&writer->lock);
+  while (writer->queued == GOLDEN_WRITER_POOL)
+    pthread_cond_wait(&writer->cond, &writer->lock);
+  slot = (writer->head + writer->queued) % GOLDEN_WRITER_POOL;
+  pthread_mutex_unlock(&writer->lock);
+
+  /* Only the producer fills free buffers, so this copy needs no lock */
+  memcpy(writer->pool[slot], pixels, size);
+  writer->times[slot] = time;
+
+  pthread_mutex_lock(&writer->lock);
+  writer->queued++;
+  error = writer->error;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+  return error ? -1 : 0;
+}
+
+/* Make the rename of path durable */
+static void sync_dir(const char *path)
+{
+  char *copy = strdup(path);
+  int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  free(copy);
+}
+
+/* Drain the queue, the thread exits once it is empty */
+static void stop_writer(struct golden_writer *writer)
+{
+  pthread_mutex_lock(&writer->lock);
+  writer->closing = true;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+}
+
+static void free_writer(struct golden_writer *writer)
+{
+  free(writer->index);
+  if (writer->own_buffers)
+    free(writer->buffers);
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->cond);
+  free(writer->tmp_path);
+  free(writer->path);
+  free(writer);
+}
+
+int GoldenWriterClose(struct golden_writer *writer)
+{
+  int ret = 0;
+
+  stop_writer(writer);
+  if (writer->error)
+    ret = -1;
+
+  align_file(writer->fp);
+  writer->header.index_offset = ftell(writer->fp);
+  if (fwrite(writer->index, sizeof(*writer->index), writer->header.frames,
+             writer->fp) != writer->header.frames ||
+      fseek(writer->fp, 0, SEEK_SET) < 0 ||
+      fwrite(&writer->header, sizeof(writer->header), 1, writer->fp) != 1)
+    ret = -1;
+  /* The only fsync of the whole generation run */
+  if (fflush(writer->fp) != 0 || fsync(fileno(writer->fp)) < 0)
+    ret = -1;
+  if (fclose(writer->fp) != 0)
+    ret = -1;
+  if (ret == 0 && rename(writer->tmp_path, writer->path) < 0)
+    ret = -1;
+  if (ret == 0)
+    sync_dir(writer->path);
+  if (ret < 0) {
+    perror(writer->path);
+    unlink(writer->tmp_path);
+  }
+
+  free_writer(writer);
+  return ret;
+}
+
+void GoldenWriterAbort(struct golden_writer *writer)
+{
+  stop_writer(writer);
+  fclose(writer->fp);
+  unlink(writer->tmp_path);
+  free_writer(writer);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Golden image archive: all checkpoints of one app in a single file.
+ *
+ *   struct golden_header
+ *   frame data, tile hashes ...
+ *   struct golden_entry[frames]   at header.index_offset
+ *
+ * Entry n describes checkpoint n, taken at animation time entry.time
+ * seconds. Frames are run-length encoded RGBA8;
+ * key frames encode the pixels themselves, the others the XOR against the
+ * previous checkpoint, which is mostly zero for an animated scene.
+ *
+ * Each frame also stores one Hash64() per tile_size x tile_size tile, in
+ * row-major tile order, so a test can find the tiles that changed without
+ * decoding the frame.
+ */
+#define GOLDEN_MAGIC "MGOLDEN"
+#define GOLDEN_VERSION 3
+#define GOLDEN_TILE_SIZE 32
+/* A key frame every this many checkpoints bounds random access cost */
+#define GOLDEN_KEYFRAME_INTERVAL 8
+
+#define GOLDEN_KEYFRAME (1 << 0)
+
+struct golden_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t width, height;
+  uint32_t frames;
+  uint32_t tile_size;
+  uint32_t reserved;
+  uint64_t index_offset;
+};
+
+struct golden_entry {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t flags;
+  uint64_t hash_offset;
+  double time;
+};
+
+struct golden_archive;
+struct golden_writer;
+
+/* Map an archive for reading, NULL if it is missing or malformed */
+struct golden_archive *GoldenArchiveOpen(const char *path);
+void GoldenArchiveClose(struct golden_archive *archive);
+/*
+ * Decode frames into frame, 64-byte aligned with room for width * height * 4
+ * bytes and owned by the caller until the archive is closed. Without one
+ * the archive allocates its own on the first GoldenArchiveFrame().
+ */
+void GoldenArchiveSetFrameBuffer(struct golden_archive *archive,
+                                 uint8_t *frame);
+int GoldenArchiveFrames(const struct golden_archive *archive);
+void GoldenArchiveSize(const struct golden_archive *archive,
+                       int *width, int *height);
+int GoldenArchiveTileSize(const struct golden_archive *archive);
+/* Animation time checkpoint n was taken at */
+double GoldenArchiveTime(const struct golden_archive *archive, int n);
+/*
+ * Decoded pixels of checkpoint n, valid until the next call. Sequential
+ * lookups decode a single frame; once the frame buffer exists only memory
+ * is touched, no syscalls.
+ */
+const uint8_t *GoldenArchiveFrame(struct golden_archive *archive, int n);
+
+/* Tile hashes stored for checkpoint n, GoldenTileCount() entries */
+const uint64_t *GoldenArchiveTileHashes(const struct golden_archive *archive,
+                                        int n);
+
+/* Number of tiles covering a width x height frame */
+int GoldenTileCount(int width, int height, int tile_size);
+/* Hash every tile of a tightly packed RGBA8 frame */
+void GoldenTileHashes(const uint8_t *pixels, int width, int height,
+                      int tile_size, uint64_t *hashes);
+
+/*
+ * Start writing an archive, it only replaces path once closed. Frames are
+ * encoded and written on a background thread; GoldenWriterAdd() copies the
+ * pixels into a pooled buffer and only blocks when the pool is full. Write
+ * errors are reported by later calls and by GoldenWriterClose(), which
+ * drains the queue and syncs the file once.
+ *
+ * The pool and encoder state live in buffers, GoldenWriterBufferSize()
+ * bytes, 64-byte aligned and owned by the caller until the writer is closed
+ * or aborted; NULL allocates them here.
+ */
+size_t GoldenWriterBufferSize(int width, int height);
+struct golden_writer *GoldenWriterOpen(const char *path,
+                                       int width, int height, void *buffers);
+int GoldenWriterAdd(struct golden_writer *writer, const uint8_t *pixels,
+                    double time);
+int GoldenWriterClose(struct golden_writer *writer);
+
+/* Drop an unfinished archive, path is left as it was */
+void GoldenWriterAbort(struct golden_writer *writer);
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "histogram.h"
+
+static int bucket_index(uint64_t value)
+{
+  int exponent, shift;
+
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return value;
+  exponent = 63 - __builtin_clzll(value);
+  shift = exponent - HISTOGRAM_SUB_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+         (int) (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/* Highest value that falls into bucket i */
+static uint64_t bucket_value(int i)
+{
+  int shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub = i % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+
+  if (shift < 0)
+    return i;
+  return ((sub + 1) << shift) - 1;
+}
+
+void HistogramRecord(struct histogram *histogram, uint64_t value)
+{
+  uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  uint64_t us = value / 1000;
+
+  atomic_fetch_add_explicit(&histogram->counts[bucket_index(value)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->sum_us, us, memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->sum_sq_us, us * us,
+                            memory_order_relaxed);
+  while (value > max &&
+         !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+    ;
+  atomic_fetch_add_explicit(&histogram->total, 1, memory_order_release);
+}
+
+uint64_t HistogramPercentile(const struct histogram *histogram,
+                             double fraction)
+{
+  uint64_t total = atomic_load_explicit(&histogram->total,
+                                        memory_order_acquire);
+  uint64_t rank = (uint64_t) ceil(fraction * total), seen = 0;
+  uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  int i;
+
+  if (rank == 0)
+    rank = 1;
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    if (seen >= rank)
+      // The bucket's upper bound, but never past the largest record
+      return bucket_value(i) < max ? bucket_value(i) : max;
+  }
+  return max;
+}
+
+uint64_t HistogramCountAbove(const struct histogram *histogram,
+                             uint64_t value)
+{
+  uint64_t count = 0;
+  int i;
+
+  for (i = bucket_index(value) + 1; i < HISTOGRAM_BUCKETS; i++)
+    count += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+  return count;
+}
+
+void HistogramStats(const struct histogram *histogram,
+                    struct histogram_stats *stats)
+{
+  double mean_us, var_us;
+
+  memset(stats, 0, sizeof(*stats));
+  stats->count = atomic_load_explicit(&histogram->total, memory_order_acquire);
+  if (!stats->count)
+    return;
+  stats->p50 = HistogramPercentile(histogram, 0.5);
+  stats->p90 = HistogramPercentile(histogram, 0.9);
+  stats->p99 = HistogramPercentile(histogram, 0.99);
+  stats->p999 = HistogramPercentile(histogram, 0.999);
+  stats->max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+  mean_us = (double) atomic_load_explicit(&histogram->sum_us,
+                                          memory_order_relaxed) / stats->count;
+  var_us = (double) atomic_load_explicit(&histogram->sum_sq_us,
+                                         memory_order_relaxed) / stats->count -
+           mean_us * mean_us;
+  stats->mean = mean_us * 1000.0;
+  stats->stddev = var_us > 0.0 ? sqrt(var_us) * 1000.0 : 0.0;
+}
+
+void HistogramReset(struct histogram *histogram)
+{
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    atomic_store_explicit(&histogram->counts[i], 0, memory_order_relaxed);
+  atomic_store_explicit(&histogram->max, 0, memory_order_relaxed);
+  atomic_store_explicit(&histogram->sum_us, 0, memory_order_relaxed);
+  atomic_store_explicit(&histogram->sum_sq_us, 0, memory_order_relaxed);
+  atomic_store_explicit(&histogram->total, 0, memory_order_release);
+}
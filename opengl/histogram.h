@@ -0,0 +1,67 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * HDR style histogram of nanosecond values: every power of two range is
+ * split into HISTOGRAM_SUB_BUCKETS linear buckets, so any recorded value
+ * is known to within 1/32 (about 3%) from 1 ns up to the full 64-bit
+ * range. Recording is a couple of relaxed atomic adds and never takes a
+ * lock, so any thread may record while another one reports.
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+  _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+  _Atomic uint64_t total, max;
+  /* For mean and standard deviation, in microseconds to keep sum_sq small */
+  _Atomic uint64_t sum_us, sum_sq_us;
+};
+
+/* Summary of a histogram, all times in nanoseconds */
+struct histogram_stats {
+  uint64_t count;
+  uint64_t p50, p90, p99, p999, max;
+  double mean, stddev;
+};
+
+void HistogramRecord(struct histogram *histogram, uint64_t value);
+/* Smallest value at or above the given fraction (0..1) of the records */
+uint64_t HistogramPercentile(const struct histogram *histogram,
+                             double fraction);
+/* Number of records above value, to within the bucket precision */
+uint64_t HistogramCountAbove(const struct histogram *histogram,
+                             uint64_t value);
+void HistogramStats(const struct histogram *histogram,
+                    struct histogram_stats *stats);
+/* Not atomic as a whole, don't reset while other threads record */
+void HistogramReset(struct histogram *histogram);
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Tolerant golden image comparator.
+ *
+ * Images are compared a row at a time. The vector kernels compute the
+ * absolute per-channel difference of a group of pixels, fold it into the
+ * running max and sum of squares, and turn "any channel above tolerance"
+ * into a per-pixel bit mask, so the bad pixel count and bounding box only
+ * cost work for groups that actually contain bad pixels.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#include "imgcompare.h"
+
+struct row_stats {
+  uint32_t bad;
+  int first, last;    /* x of the first/last bad pixel, -1 if none */
+  unsigned max_delta;
+  uint64_t sse;       /* sum of squared channel differences */
+};
+
+typedef void (*row_func)(const uint8_t *a, const uint8_t *b, int width,
+                         const uint8_t tolerance[4], struct row_stats *row);
+
+static void mark_bad(struct row_stats *row, int x)
+{
+  if (row->first < 0)
+    row->first = x;
+  row->last = x;
+  row->bad++;
+}
+
+/* Mark the pixels set in mask, bit n being pixel x + n */
+static void mark_bad_mask(struct row_stats *row, int x, unsigned mask)
+{
+  if (row->first < 0)
+    row->first = x + __builtin_ctz(mask);
+  row->last = x + 31 - __builtin_clz(mask);
+  row->bad += __builtin_popcount(mask);
+}
+
+/* Plain C version, also used for the row tails of the vector kernels */
+static void diff_row_scalar(const uint8_t *a, const uint8_t *b, int x,
+                            int width, const uint8_t tolerance[4],
+                            struct row_stats *row)
+{
+  for (; x < width; x++) {
+    bool bad = false;
+    for (int c = 0; c < 4; c++) {
+      int d = abs(a[x * 4 + c] - b[x * 4 + c]);
+      if (d > row->max_delta)
+        row->max_delta = d;
+      row->sse += d * d;
+      if (d > tolerance[c])
+        bad = true;
+    }
+    if (bad)
+      mark_bad(row, x);
+  }
+}
+
+static void diff_row_c(const uint8_t *a, const uint8_t *b, int width,
+                       const uint8_t tolerance[4], struct row_stats *row)
+{
+  diff_row_scalar(a, b, 0, width, tolerance, row);
+}
+
+#ifdef HAVE_SSE2
+/*
+ * The signed 32-bit sum of squares lanes grow by at most 4 * 255^2 per
+ * group, flush them to 64 bits well before that can overflow.
+ */
+#define SSE_FLUSH_GROUPS 4096
+
+static uint64_t sum_epi32(__m128i v)
+{
+  uint32_t l[4];
+  _mm_storeu_si128((__m128i *) l, v);
+  return (uint64_t) l[0] + l[1] + l[2] + l[3];
+}
+
+static unsigned max_epu8(__m128i v)
+{
+  uint8_t l[16];
+  unsigned m = 0;
+  _mm_storeu_si128((__m128i *) l, v);
+  for (int i = 0; i < 16; i++)
+    if (l[i] > m)
+      m = l[i];
+  return m;
+}
+
+__attribute__((target("sse2")))
+static void diff_row_sse2(const uint8_t *a, const uint8_t *b, int width,
+                          const uint8_t tolerance[4], struct row_stats *row)
+{
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t tol32;
+  __m128i tol, vmax = zero, vsse = zero;
+  int x, groups = 0;
+
+  memcpy(&tol32, tolerance, 4);
+  tol = _mm_set1_epi32(tol32);
+
+  for (x = 0; x + 4 <= width; x += 4) {
+    __m128i va = _mm_loadu_si128((const __m128i *) (a + x * 4));
+    __m128i vb = _mm_loadu_si128((const __m128i *) (b + x * 4));
+    __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+    __m128i lo = _mm_unpacklo_epi8(d, zero);
+    __m128i hi = _mm_unpackhi_epi8(d, zero);
+    __m128i over = _mm_subs_epu8(d, tol);
+    unsigned mask;
+
+    vmax = _mm_max_epu8(vmax, d);
+    vsse = _mm_add_epi32(vsse, _mm_madd_epi16(lo, lo));
+    vsse = _mm_add_epi32(vsse, _mm_madd_epi16(hi, hi));
+    if (++groups == SSE_FLUSH_GROUPS) {
+      row->sse += sum_epi32(vsse);
+      vsse = zero;
+      groups = 0;
+    }
+
+    mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(over, zero)));
+    mask ^= 0xf;
+    if (mask)
+      mark_bad_mask(row, x, mask);
+  }
+  row->sse += sum_epi32(vsse);
+  if (max_epu8(vmax) > row->max_delta)
+    row->max_delta = max_epu8(vmax);
+
+  diff_row_scalar(a, b, x, width, tolerance, row);
+}
+
+__attribute__((target("avx2")))
+static void diff_row_avx2(const uint8_t *a, const uint8_t *b, int width,
+                          const uint8_t tolerance[4], struct row_stats *row)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t tol32;
+  __m256i tol, vmax = zero, vsse = zero;
+  int x, groups = 0;
+
+  memcpy(&tol32, tolerance, 4);
+  tol = _mm256_set1_epi32(tol32);
+
+  for (x = 0; x + 8 <= width; x += 8) {
+    __m256i va = _mm256_loadu_si256((const __m256i *) (a + x * 4));
+    __m256i vb = _mm256_loadu_si256((const __m256i *) (b + x * 4));
+    __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb),
+                                _mm256_subs_epu8(vb, va));
+    __m256i lo = _mm256_unpacklo_epi8(d, zero);
+    __m256i hi = _mm256_unpackhi_epi8(d, zero);
+    __m256i over = _mm256_subs_epu8(d, tol);
+    unsigned mask;
+
+    vmax = _mm256_max_epu8(vmax, d);
+    vsse = _mm256_add_epi32(vsse, _mm256_madd_epi16(lo, lo));
+    vsse = _mm256_add_epi32(vsse, _mm256_madd_epi16(hi, hi));
+    if (++groups == SSE_FLUSH_GROUPS) {
+      row->sse += sum_epi32(_mm256_castsi256_si128(vsse)) +
+                  sum_epi32(_mm256_extracti128_si256(vsse, 1));
+      vsse = zero;
+      groups = 0;
+    }
+
+    mask = _mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(over, zero)));
+    mask ^= 0xff;
+    if (mask)
+      mark_bad_mask(row, x, mask);
+  }
+  row->sse += sum_epi32(_mm256_castsi256_si128(vsse)) +
+              sum_epi32(_mm256_extracti128_si256(vsse, 1));
+  vmax = _mm256_max_epu8(vmax, _mm256_permute2x128_si256(vmax, vmax, 1));
+  if (max_epu8(_mm256_castsi256_si128(vmax)) > row->max_delta)
+    row->max_delta = max_epu8(_mm256_castsi256_si128(vmax));
+
+  diff_row_scalar(a, b, x, width, tolerance, row);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void diff_row_neon(const uint8_t *a, const uint8_t *b, int width,
+                          const uint8_t tolerance[4], struct row_stats *row)
+{
+  uint32_t tol32;
+  uint8x16_t tol, vmax = vdupq_n_u8(0);
+  uint32x4_t vsse = vdupq_n_u32(0);
+  uint8_t m[16];
+  int x;
+
+  memcpy(&tol32, tolerance, 4);
+  tol = vreinterpretq_u8_u32(vdupq_n_u32(tol32));
+
+  for (x = 0; x + 4 <= width; x += 4) {
+    uint8x16_t d = vabdq_u8(vld1q_u8(a + x * 4), vld1q_u8(b + x * 4));
+    uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(d));
+    uint16x8_t hi = vmull_u8(vget_high_u8(d), vget_high_u8(d));
+    uint32x4_t over = vreinterpretq_u32_u8(vqsubq_u8(d, tol));
+    uint32_t bad[4];
+
+    vmax = vmaxq_u8(vmax, d);
+    /* Lanes grow by at most 4 * 255^2 per group, so a 32-bit lane only
+     * wraps for rows of more than 60000 pixels */
+    vsse = vpadalq_u16(vsse, lo);
+    vsse = vpadalq_u16(vsse, hi);
+
+    vst1q_u32(bad, vtstq_u32(over, over));
+    if (bad[0] | bad[1] | bad[2] | bad[3]) {
+      unsigned mask = (bad[0] & 1) | (bad[1] & 2) | (bad[2] & 4) |
+                      (bad[3] & 8);
+      mark_bad_mask(row, x, mask);
+    }
+  }
+  row->sse += (uint64_t) vgetq_lane_u32(vsse, 0) + vgetq_lane_u32(vsse, 1) +
+              vgetq_lane_u32(vsse, 2) + vgetq_lane_u32(vsse, 3);
+  vst1q_u8(m, vmax);
+  for (int i = 0; i < 16; i++)
+    if (m[i] > row->max_delta)
+      row->max_delta = m[i];
+
+  diff_row_scalar(a, b, x, width, tolerance, row);
+}
+#endif
+
+static row_func diff_row = diff_row_c;
+static const char *diff_row_name = "C";
+static pthread_once_t diff_row_once = PTHREAD_ONCE_INIT;
+
+static void select_diff_row(void)
+{
+#ifdef HAVE_SSE2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    diff_row = diff_row_avx2;
+    diff_row_name = "AVX2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    diff_row = diff_row_sse2;
+    diff_row_name = "SSE2";
+  }
+#elif defined(HAVE_NEON)
+  diff_row = diff_row_neon;
+  diff_row_name = "NEON";
+#endif
+}
+
+const char *CompareImagesImpl(void)
+{
+  pthread_once(&diff_row_once, select_diff_row);
+  return diff_row_name;
+}
+
+void CompareImageRegion(const uint8_t *a, const uint8_t *b, int stride,
+                        int x, int y, int width, int height,
+                        const uint8_t tolerance[4], struct img_diff *diff)
+{
+  uint64_t sse = 0;
+  int row_y;
+
+  pthread_once(&diff_row_once, select_diff_row);
+
+  memset(diff, 0, sizeof(*diff));
+  diff->x0 = x + width;
+  diff->y0 = y + height;
+  diff->x1 = diff->y1 = -1;
+
+  for (row_y = y; row_y < y + height; row_y++) {
+    struct row_stats row = { 0, -1, -1, 0, 0 };
+    size_t offset = (size_t) row_y * stride + (size_t) x * 4;
+
+    diff_row(a + offset, b + offset, width, tolerance, &row);
+    sse += row.sse;
+    if (row.max_delta > diff->max_delta)
+      diff->max_delta = row.max_delta;
+    if (row.bad) {
+      diff->bad_pixels += row.bad;
+      if (x + row.first < diff->x0)
+        diff->x0 = x + row.first;
+      if (x + row.last > diff->x1)
+        diff->x1 = x + row.last;
+      if (diff->y1 < 0)
+        diff->y0 = row_y;
+      diff->y1 = row_y;
+    }
+  }
+
+  diff->sse = sse;
+  if (sse == 0)
+    diff->psnr = INFINITY;
+  else
+    diff->psnr = 10.0 * log10(255.0 * 255.0 * 4.0 * width * height / sse);
+}
+
+void CompareImages(const uint8_t *a, const uint8_t *b, int width, int height,
+                   const uint8_t tolerance[4], struct img_diff *diff)
+{
+  CompareImageRegion(a, b, width * 4, 0, 0, width, height, tolerance, diff);
+}
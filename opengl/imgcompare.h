@@ -0,0 +1,64 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef IMGCOMPARE_H
+#define IMGCOMPARE_H
+
+#include <stdint.h>
+
+/* Result of comparing two RGBA8 images */
+struct img_diff {
+  /* Pixels where any channel differs by more than the tolerance */
+  uint64_t bad_pixels;
+  /* Largest per-channel difference over the whole image */
+  unsigned max_delta;
+  /* Sum of squared channel differences */
+  uint64_t sse;
+  /* Peak signal-to-noise ratio in dB, INFINITY for identical images */
+  double psnr;
+  /* Bounding box of the bad pixels (inclusive), only valid if bad_pixels */
+  int x0, y0, x1, y1;
+};
+
+/*
+ * Compare two tightly packed RGBA8 images of width x height pixels. A pixel
+ * is bad when the absolute difference of any channel exceeds the matching
+ * entry in tolerance[] (R, G, B, A). Uses SSE2/AVX2 or NEON when the CPU
+ * has them.
+ */
+void CompareImages(const uint8_t *a, const uint8_t *b, int width, int height,
+                   const uint8_t tolerance[4], struct img_diff *diff);
+
+/*
+ * Same as CompareImages() for the width x height region at (x, y) of two
+ * images with stride bytes per row. The bounding box is in image
+ * coordinates.
+ */
+void CompareImageRegion(const uint8_t *a, const uint8_t *b, int stride,
+                        int x, int y, int width, int height,
+                        const uint8_t tolerance[4], struct img_diff *diff);
+
+/* Name of the compare implementation picked for this CPU */
+const char *CompareImagesImpl(void);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Timer queries are recorded into a ring of QUERY_FRAMES frames and read
+ * back once their results are available, a few frames later. When the
+ * ring is full the frame is simply not timed on the GPU.
+ *
+ * Without timer queries a fence is dropped after every phase and a waiter
+ * thread timestamps each fence as it signals. A phase's GPU time is then
+ * estimated as the time from the later of its CPU start and the previous
+ * fence signalling up to its own fence signalling.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+#include "histogram.h"
+#include "perfcount.h"
+#include "phasetimer.h"
+#include "trace.h"
+
+/* Frames of timer queries in flight */
+#define QUERY_FRAMES 8
+/* Fences in flight for the fallback */
+#define FENCE_RING 32
+
+enum method {
+  METHOD_NONE,
+  METHOD_QUERY,
+  METHOD_FENCE,
+};
+
+static const char *phase_names[PHASE_COUNT] = { "draw", "readback", "swap" };
+
+struct phase_times {
+  struct histogram cpu, gpu;
+};
+
+static struct {
+  enum method method;
+  EGLDisplay dpy;
+  double cpu_begin[PHASE_COUNT];
+  uint64_t trace_begin[PHASE_COUNT];
+  struct phase_times interval[PHASE_COUNT], run[PHASE_COUNT];
+  /* CPU counters per phase for the run, when -perf enabled them */
+  struct perf_phase perf[PHASE_COUNT];
+  uint64_t dropped;   /* frames or phases not timed on the GPU */
+} timer;
+
+static struct {
+  PFNGLGENQUERIESEXTPROC GenQueries;
+  PFNGLBEGINQUERYEXTPROC BeginQuery;
+  PFNGLENDQUERYEXTPROC EndQuery;
+  PFNGLGETQUERYOBJECTUIVEXTPROC GetQueryObjectuiv;
+  PFNGLGETQUERYOBJECTUI64VEXTPROC GetQueryObjectui64v;
+  struct {
+    GLuint ids[PHASE_COUNT];
+    bool used[PHASE_COUNT];
+  } frames[QUERY_FRAMES];
+  int head, count;
+  int current;        /* frame being recorded, -1 if none */
+  bool skip;          /* ring was full when this frame started */
+  bool primed;        /* first frame collected and thrown away */
+} query = { .current = -1 };
+
+static struct {
+  PFNEGLCREATESYNCKHRPROC CreateSync;
+  PFNEGLDESTROYSYNCKHRPROC DestroySync;
+  PFNEGLCLIENTWAITSYNCKHRPROC ClientWaitSync;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct {
+    EGLSyncKHR sync;
+    enum phase phase;
+    double cpu_begin;
+  } ring[FENCE_RING];
+  int head, count;
+} fence = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void record(enum phase phase, bool gpu, uint64_t ns)
+{
+  HistogramRecord(gpu ? &timer.interval[phase].gpu
+                      : &timer.interval[phase].cpu, ns);
+  HistogramRecord(gpu ? &timer.run[phase].gpu : &timer.run[phase].cpu, ns);
+}
+
+static bool has_extension(const char *extensions, const char *name)
+{
+  size_t len = strlen(name);
+  const char *p = extensions;
+
+  while (p && (p = strstr(p, name))) {
+    if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || !p[len]))
+      return true;
+    p += len;
+  }
+  return false;
+}
+
+static void *FenceWaiter(void *arg)
+{
+  double last_signal = 0.0;
+
+  pthread_mutex_lock(&fence.lock);
+  while (1) {
+    while (fence.count == 0)
+      pthread_cond_wait(&fence.wake, &fence.lock);
+    EGLSyncKHR sync = fence.ring[fence.head].sync;
+    enum phase phase = fence.ring[fence.head].phase;
+    double begin = fence.ring[fence.head].cpu_begin;
+    pthread_mutex_unlock(&fence.lock);
+
+    // The render thread flushes after each fence, no flush bit needed
+    fence.ClientWaitSync(timer.dpy, sync, 0, EGL_FOREVER_KHR);
+    double t = now();
+    fence.DestroySync(timer.dpy, sync);
+    if (begin > last_signal)
+      last_signal = begin;
+    record(phase, true, (t - last_signal) * 1000000000.0);
+    last_signal = t;
+
+    pthread_mutex_lock(&fence.lock);
+    fence.head = (fence.head + 1) % FENCE_RING;
+    fence.count--;
+  }
+  return NULL;
+}
+
+void PhaseTimerInit(EGLDisplay dpy)
+{
+  const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+  GLint disjoint;
+  int i;
+
+  timer.dpy = dpy;
+  for (i = 0; i < PHASE_COUNT; i++)
+    timer.perf[i].name = phase_names[i];
+  if (has_extension(extensions, "GL_EXT_disjoint_timer_query")) {
+    query.GenQueries = (void *) eglGetProcAddress("glGenQueriesEXT");
+    query.BeginQuery = (void *) eglGetProcAddress("glBeginQueryEXT");
+    query.EndQuery = (void *) eglGetProcAddress("glEndQueryEXT");
+    query.GetQueryObjectuiv =
+        (void *) eglGetProcAddress("glGetQueryObjectuivEXT");
+    query.GetQueryObjectui64v =
+        (void *) eglGetProcAddress("glGetQueryObjectui64vEXT");
+    if (query.GenQueries && query.BeginQuery && query.EndQuery &&
+        query.GetQueryObjectuiv && query.GetQueryObjectui64v) {
+      for (i = 0; i < QUERY_FRAMES; i++)
+        query.GenQueries(PHASE_COUNT, query.frames[i].ids);
+      // Clear a disjoint event left over from context creation
+      glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+      timer.method = METHOD_QUERY;
+      return;
+    }
+  }
+
+  if (has_extension(eglQueryString(dpy, EGL_EXTENSIONS),
+                    "EGL_KHR_fence_sync")) {
+    fence.CreateSync = (void *) eglGetProcAddress("eglCreateSyncKHR");
+    fence.DestroySync = (void *) eglGetProcAddress("eglDestroySyncKHR");
+    fence.ClientWaitSync = (void *) eglGetProcAddress("eglClientWaitSyncKHR");
+    if (fence.CreateSync && fence.DestroySync && fence.ClientWaitSync &&
+        pthread_create(&fence.thread, NULL, FenceWaiter, NULL) == 0) {
+      timer.method = METHOD_FENCE;
+      return;
+    }
+  }
+  fprintf(stderr, "no GPU timer queries or fences, timing the CPU only\n");
+}
+
+const char *PhaseTimerMethod(void)
+{
+  switch (timer.method) {
+  case METHOD_QUERY:
+    return "timer query";
+  case METHOD_FENCE:
+    return "fence estimate";
+  default:
+    return "none";
+  }
+}
+
+void PhaseBegin(enum phase phase)
+{
+  timer.cpu_begin[phase] = now();
+  timer.trace_begin[phase] = TraceNow();
+
+  if (timer.method == METHOD_QUERY && query.current < 0 && !query.skip) {
+    if (query.count == QUERY_FRAMES) {
+      query.skip = true;
+      timer.dropped++;
+    } else {
+      query.current = (query.head + query.count++) % QUERY_FRAMES;
+      memset(query.frames[query.current].used, 0,
+             sizeof(query.frames[query.current].used));
+    }
+  }
+  if (timer.method == METHOD_QUERY && query.current >= 0) {
+    query.BeginQuery(GL_TIME_ELAPSED_EXT,
+                     query.frames[query.current].ids[phase]);
+    query.frames[query.current].used[phase] = true;
+  }
+  PerfBegin(&timer.perf[phase]);
+}
+
+void PhaseEnd(enum phase phase)
+{
+  PerfEnd(&timer.perf[phase]);
+  TraceSpan(phase_names[phase], "frame", timer.trace_begin[phase]);
+  record(phase, false, (now() - timer.cpu_begin[phase]) * 1000000000.0);
+
+  if (timer.method == METHOD_QUERY && query.current >= 0) {
+    query.EndQuery(GL_TIME_ELAPSED_EXT);
+  } else if (timer.method == METHOD_FENCE) {
+    EGLSyncKHR sync;
+
+    pthread_mutex_lock(&fence.lock);
+    if (fence.count == FENCE_RING) {
+      pthread_mutex_unlock(&fence.lock);
+      timer.dropped++;
+      return;
+    }
+    pthread_mutex_unlock(&fence.lock);
+
+    sync = fence.CreateSync(timer.dpy, EGL_SYNC_FENCE_KHR, NULL);
+    if (sync == EGL_NO_SYNC_KHR)
+      return;
+    glFlush();
+
+    pthread_mutex_lock(&fence.lock);
+    int tail = (fence.head + fence.count) % FENCE_RING;
+    fence.ring[tail].sync = sync;
+    fence.ring[tail].phase = phase;
+    fence.ring[tail].cpu_begin = timer.cpu_begin[phase];
+    fence.count++;
+    pthread_cond_signal(&fence.wake);
+    pthread_mutex_unlock(&fence.lock);
+  }
+}
+
+void PhaseTimerEndFrame(void)
+{
+  GLint disjoint = 0;
+  int i;
+
+  if (timer.method != METHOD_QUERY)
+    return;
+  query.current = -1;
+  query.skip = false;
+
+  while (query.count > 0) {
+    int f = query.head;
+    bool available = true, discard;
+
+    for (i = 0; i < PHASE_COUNT && available; i++) {
+      GLuint ready = GL_TRUE;
+      if (query.frames[f].used[i])
+        query.GetQueryObjectuiv(query.frames[f].ids[i],
+                                GL_QUERY_RESULT_AVAILABLE_EXT, &ready);
+      available = ready == GL_TRUE;
+    }
+    if (!available)
+      break;
+
+    // Frequency changes or a context switch make the results meaningless.
+    // The very first frame is dropped too, llvmpipe for one returns the
+    // raw end timestamp for the first query of a context.
+    if (!disjoint)
+      glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    discard = disjoint || !query.primed;
+    query.primed = true;
+    for (i = 0; i < PHASE_COUNT; i++) {
+      GLuint64 ns;
+      if (!query.frames[f].used[i])
+        continue;
+      query.GetQueryObjectui64v(query.frames[f].ids[i], GL_QUERY_RESULT_EXT,
+                                &ns);
+      if (!discard)
+        record(i, true, ns);
+    }
+    if (discard)
+      timer.dropped++;
+    query.head = (query.head + 1) % QUERY_FRAMES;
+    query.count--;
+  }
+}
+
+void PhaseTimerStartRun(void)
+{
+  int i;
+
+  for (i = 0; i < PHASE_COUNT; i++) {
+    HistogramReset(&timer.run[i].cpu);
+    HistogramReset(&timer.run[i].gpu);
+  }
+  PerfReset(timer.perf, PHASE_COUNT);
+}
+
+void PhaseTimerReport(const char *label, bool run, FILE *json)
+{
+  struct phase_times *times = run ? timer.run : timer.interval;
+  struct histogram_stats cpu[PHASE_COUNT], gpu[PHASE_COUNT];
+  int i;
+
+  for (i = 0; i < PHASE_COUNT; i++) {
+    HistogramStats(&times[i].cpu, &cpu[i]);
+    HistogramStats(&times[i].gpu, &gpu[i]);
+    if (!cpu[i].count)
+      continue;
+    printf("%s %-8s ms: cpu p50 %.3f p99 %.3f max %.3f", label,
+           phase_names[i], cpu[i].p50 / 1e6, cpu[i].p99 / 1e6,
+           cpu[i].max / 1e6);
+    if (gpu[i].count)
+      printf(", gpu p50 %.3f p99 %.3f max %.3f (%s)", gpu[i].p50 / 1e6,
+             gpu[i].p99 / 1e6, gpu[i].max / 1e6, PhaseTimerMethod());
+    printf("\n");
+  }
+
+  if (json) {
+    fprintf(json, "{\"report\":\"%s-phases\",\"method\":\"%s\","
+            "\"untimed\":%llu", label, PhaseTimerMethod(),
+            (unsigned long long) timer.dropped);
+    for (i = 0; i < PHASE_COUNT; i++) {
+      if (!cpu[i].count)
+        continue;
+      fprintf(json, ",\"%s\":{\"cpu_p50_ms\":%.3f,\"cpu_p99_ms\":%.3f,"
+              "\"cpu_max_ms\":%.3f", phase_names[i], cpu[i].p50 / 1e6,
+              cpu[i].p99 / 1e6, cpu[i].max / 1e6);
+      if (gpu[i].count)
+        fprintf(json, ",\"gpu_p50_ms\":%.3f,\"gpu_p99_ms\":%.3f,"
+                "\"gpu_max_ms\":%.3f", gpu[i].p50 / 1e6, gpu[i].p99 / 1e6,
+                gpu[i].max / 1e6);
+      fprintf(json, "}");
+    }
+    fprintf(json, "}\n");
+    fflush(json);
+  }
+
+  if (run) {
+    PerfReport(label, timer.perf, PHASE_COUNT, json);
+  } else {
+    // Timings still in flight may land in either interval
+    for (i = 0; i < PHASE_COUNT; i++) {
+      HistogramReset(&times[i].cpu);
+      HistogramReset(&times[i].gpu);
+    }
+  }
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PHASETIMER_H
+#define PHASETIMER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <EGL/egl.h>
+
+/* Parts of a frame timed separately on the CPU and on the GPU */
+enum phase {
+  PHASE_DRAW,       /* the gears' draw call */
+  PHASE_READBACK,   /* golden/capture readbacks queued by HandleFrame */
+  PHASE_SWAP,       /* eglSwapBuffers */
+  PHASE_COUNT,
+};
+
+/*
+ * Pick the GPU timing method for the current context:
+ * EXT_disjoint_timer_query when the driver has it, estimates from
+ * EGL_KHR_fence_sync fences otherwise (e.g. some Mesa software drivers),
+ * CPU submission times only if neither is available.
+ */
+void PhaseTimerInit(EGLDisplay dpy);
+const char *PhaseTimerMethod(void);
+
+/* Bracket one phase, phases must not overlap. Also traced with -trace */
+void PhaseBegin(enum phase phase);
+void PhaseEnd(enum phase phase);
+
+/*
+ * Call once per frame after the swap. Collects the GPU timings that have
+ * become available, without ever waiting for the GPU.
+ */
+void PhaseTimerEndFrame(void);
+
+/* Drop the whole-run timings gathered so far, e.g. during a warm-up */
+void PhaseTimerStartRun(void);
+
+/*
+ * Print per-phase CPU and GPU time percentiles for the current report
+ * interval (resetting it) or, with run set, for the whole run. A JSON
+ * object is written to json as well unless it is NULL.
+ */
+void PhaseTimerReport(const char *label, bool run, FILE *json);
+
+#endif
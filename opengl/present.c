@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <wayland-client.h>
+
+#include "histogram.h"
+#include "present.h"
+#include "presentation-time-client-protocol.h"
+
+/* Feedback requests in flight, frames beyond that go unmeasured */
+#define MAX_FEEDBACK 32
+
+struct present_stats {
+  struct histogram latency;
+  uint64_t presented, discarded, missed;
+};
+
+struct feedback {
+  struct wp_presentation_feedback *feedback;
+  uint64_t submit;   /* ns on the presentation clock */
+};
+
+static struct {
+  struct wp_presentation *presentation;
+  clockid_t clock;
+  struct feedback pool[MAX_FEEDBACK];
+  uint64_t last_present, last_seq;
+  uint32_t refresh;   /* ns, 0 if unknown */
+  uint64_t unmeasured;
+  struct present_stats interval, run;
+} present = { .clock = CLOCK_MONOTONIC };
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(present.clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void presentation_clock_id(void *data,
+                                  struct wp_presentation *presentation,
+                                  uint32_t clk_id)
+{
+  present.clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+  presentation_clock_id,
+};
+
+static void feedback_done(struct feedback *f)
+{
+  wp_presentation_feedback_destroy(f->feedback);
+  f->feedback = NULL;
+}
+
+static void feedback_sync_output(void *data,
+                                 struct wp_presentation_feedback *feedback,
+                                 struct wl_output *output)
+{
+}
+
+static void feedback_presented(void *data,
+                               struct wp_presentation_feedback *feedback,
+                               uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+                               uint32_t tv_nsec, uint32_t refresh,
+                               uint32_t seq_hi, uint32_t seq_lo,
+                               uint32_t flags)
+{
+  struct feedback *f = data;
+  uint64_t t = (((uint64_t) tv_sec_hi << 32 | tv_sec_lo) * 1000000000) +
+               tv_nsec;
+  uint64_t seq = (uint64_t) seq_hi << 32 | seq_lo;
+  uint64_t missed = 0;
+  bool vsync = flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
+
+  /*
+   * Refresh cycles skipped since the previous presented frame: from the
+   * output's sequence counter when it has one, from the timestamps
+   * otherwise
+   */
+  if (present.last_present && refresh && vsync) {
+    if (seq && present.last_seq && seq > present.last_seq)
+      missed = seq - present.last_seq - 1;
+    else if (t > present.last_present)
+      missed = (t - present.last_present + refresh / 2) / refresh - 1;
+  }
+  present.last_present = t;
+  present.last_seq = seq;
+  present.refresh = refresh;
+
+  HistogramRecord(&present.interval.latency, t > f->submit ? t - f->submit : 0);
+  HistogramRecord(&present.run.latency, t > f->submit ? t - f->submit : 0);
+  present.interval.presented++;
+  present.run.presented++;
+  present.interval.missed += missed;
+  present.run.missed += missed;
+  feedback_done(f);
+}
+
+static void feedback_discarded(void *data,
+                               struct wp_presentation_feedback *feedback)
+{
+  present.interval.discarded++;
+  present.run.discarded++;
+  feedback_done(data);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+  feedback_sync_output,
+  feedback_presented,
+  feedback_discarded,
+};
+
+void PresentBind(struct wl_registry *registry, uint32_t name,
+                 uint32_t version)
+{
+  present.presentation = wl_registry_bind(registry, name,
+                                          &wp_presentation_interface, 1);
+  wp_presentation_add_listener(present.presentation, &presentation_listener,
+                               NULL);
+}
+
+bool PresentAvailable(void)
+{
+  return present.presentation != NULL;
+}
+
+void PresentFrame(struct wl_surface *surface)
+{
+  int i;
+
+  if (!present.presentation)
+    return;
+  for (i = 0; i < MAX_FEEDBACK; i++) {
+    struct feedback *f = &present.pool[i];
+    if (f->feedback)
+      continue;
+    f->feedback = wp_presentation_feedback(present.presentation, surface);
+    wp_presentation_feedback_add_listener(f->feedback, &feedback_listener, f);
+    f->submit = now();
+    return;
+  }
+  present.unmeasured++;
+}
+
+static void reset(struct present_stats *stats)
+{
+  HistogramReset(&stats->latency);
+  stats->presented = stats->discarded = stats->missed = 0;
+}
+
+void PresentStartRun(void)
+{
+  reset(&present.run);
+}
+
+void PresentReport(const char *label, bool run, FILE *json)
+{
+  struct present_stats *stats = run ? &present.run : &present.interval;
+  struct histogram_stats st;
+
+  if (!present.presentation)
+    return;
+  HistogramStats(&stats->latency, &st);
+  printf("%s present latency ms: p50 %.2f p99 %.2f max %.2f, "
+         "%llu missed refresh cycles, %llu discarded, refresh %.3f ms\n",
+         label, st.p50 / 1e6, st.p99 / 1e6, st.max / 1e6,
+         (unsigned long long) stats->missed,
+         (unsigned long long) stats->discarded, present.refresh / 1e6);
+  if (json) {
+    fprintf(json, "{\"report\":\"%s-present\",\"presented\":%llu,"
+            "\"discarded\":%llu,\"unmeasured\":%llu,"
+            "\"missed_cycles\":%llu,\"refresh_ms\":%.3f,"
+            "\"latency_p50_ms\":%.3f,\"latency_p90_ms\":%.3f,"
+            "\"latency_p99_ms\":%.3f,\"latency_max_ms\":%.3f}\n", label,
+            (unsigned long long) stats->presented,
+            (unsigned long long) stats->discarded,
+            (unsigned long long) present.unmeasured,
+            (unsigned long long) stats->missed, present.refresh / 1e6,
+            st.p50 / 1e6, st.p90 / 1e6, st.p99 / 1e6, st.max / 1e6);
+    fflush(json);
+  }
+  if (!run)
+    reset(stats);
+}
+
+void PresentRelease(void)
+{
+  int i;
+
+  for (i = 0; i < MAX_FEEDBACK; i++)
+    if (present.pool[i].feedback)
+      feedback_done(&present.pool[i]);
+  if (present.presentation)
+    wp_presentation_destroy(present.presentation);
+  present.presentation = NULL;
+}
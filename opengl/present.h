@@ -0,0 +1,65 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PRESENT_H
+#define PRESENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct wl_registry;
+struct wl_surface;
+
+/*
+ * Frame presentation feedback through the wp_presentation protocol: for
+ * every frame the compositor reports when it actually reached the screen,
+ * which gives submit-to-present latency and missed refresh cycles. Works
+ * with any compositor that has the protocol, weston's headless backend
+ * included.
+ */
+
+/* Bind the global, from the registry listener */
+void PresentBind(struct wl_registry *registry, uint32_t name,
+                 uint32_t version);
+bool PresentAvailable(void);
+
+/*
+ * Ask for feedback on the next commit of surface, call right before
+ * eglSwapBuffers(). Events arrive through wl_display_dispatch_pending().
+ */
+void PresentFrame(struct wl_surface *surface);
+
+/* Drop the whole-run statistics gathered so far, e.g. during a warm-up */
+void PresentStartRun(void);
+
+/*
+ * Print latency percentiles, missed refresh cycles, discarded frames and
+ * the refresh interval for the current report interval (resetting it) or
+ * the whole run, and as JSON to json unless it is NULL.
+ */
+void PresentReport(const char *label, bool run, FILE *json);
+
+void PresentRelease(void);
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A cache file is a small header followed by the driver's binary. The
+ * header repeats the key, so a hash collision in the file name or a
+ * truncated write is caught before the driver sees the data. Files are
+ * written under a temporary name and renamed, so concurrent processes or
+ * render threads never read a partial binary.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+#include "hash.h"
+#include "progcache.h"
+
+#define CACHE_MAGIC 0x31435047    /* "GPC1" */
+/* Bigger binaries are taken for corrupt files */
+#define MAX_BINARY_SIZE (64 << 20)
+
+struct cache_header {
+  uint32_t magic;
+  uint32_t format;
+  uint64_t key;
+  uint32_t length;
+  uint32_t reserved;
+};
+
+static struct {
+  bool enabled;
+  char dir[PATH_MAX];
+  pthread_once_t once;
+  PFNGLGETPROGRAMBINARYOESPROC GetProgramBinary;
+  PFNGLPROGRAMBINARYOESPROC ProgramBinary;
+} cache = { .once = PTHREAD_ONCE_INIT };
+
+/* mkdir -p */
+static void make_dirs(char *path)
+{
+  char *p;
+
+  for (p = path + 1; *p; p++) {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  mkdir(path, 0755);
+}
+
+void ProgramCacheOpen(const char *dir, const char *app)
+{
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n;
+
+  if (dir)
+    n = snprintf(cache.dir, sizeof(cache.dir), "%s", dir);
+  else if (base && *base)
+    n = snprintf(cache.dir, sizeof(cache.dir), "%s/%s", base, app);
+  else if (home && *home)
+    n = snprintf(cache.dir, sizeof(cache.dir), "%s/.cache/%s", home, app);
+  else
+    return;
+  if (n < 0 || n >= (int) sizeof(cache.dir))
+    return;
+  make_dirs(cache.dir);
+  cache.enabled = access(cache.dir, W_OK) == 0;
+  if (!cache.enabled)
+    fprintf(stderr, "program cache: can't write %s (%s), cache off\n",
+            cache.dir, strerror(errno));
+}
+
+static void resolve(void)
+{
+  const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+  const char *version = (const char *) glGetString(GL_VERSION);
+
+  if (extensions && strstr(extensions, "GL_OES_get_program_binary")) {
+    cache.GetProgramBinary = (PFNGLGETPROGRAMBINARYOESPROC)
+        eglGetProcAddress("glGetProgramBinaryOES");
+    cache.ProgramBinary = (PFNGLPROGRAMBINARYOESPROC)
+        eglGetProcAddress("glProgramBinaryOES");
+  } else if (version && strncmp(version, "OpenGL ES 3", 11) == 0) {
+    cache.GetProgramBinary = (PFNGLGETPROGRAMBINARYOESPROC)
+        eglGetProcAddress("glGetProgramBinary");
+    cache.ProgramBinary = (PFNGLPROGRAMBINARYOESPROC)
+        eglGetProcAddress("glProgramBinary");
+  }
+}
+
+/* True if the current context can save and load program binaries */
+static bool supported(void)
+{
+  GLint formats = 0;
+
+  if (!cache.enabled)
+    return false;
+  pthread_once(&cache.once, resolve);
+  if (!cache.GetProgramBinary || !cache.ProgramBinary)
+    return false;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+  return formats > 0;
+}
+
+static uint64_t cache_key(const char *const *sources, int count)
+{
+  const char *driver[] = {
+    (const char *) glGetString(GL_RENDERER),
+    (const char *) glGetString(GL_VERSION),
+  };
+  uint64_t key = CACHE_MAGIC;
+  int i;
+
+  for (i = 0; i < 2; i++)
+    if (driver[i])
+      key = Hash64(driver[i], strlen(driver[i]) + 1, key);
+  // The terminating NULs keep "ab" + "c" apart from "a" + "bc"
+  for (i = 0; i < count; i++)
+    key = Hash64(sources[i], strlen(sources[i]) + 1, key);
+  return key;
+}
+
+static void cache_path(char *path, size_t size, uint64_t key)
+{
+  snprintf(path, size, "%s/%016llx.bin", cache.dir, (unsigned long long) key);
+}
+
+GLuint ProgramCacheLoad(const char *const *sources, int count)
+{
+  char path[PATH_MAX + 32];
+  struct cache_header header;
+  void *binary = NULL;
+  GLuint program = 0;
+  GLint linked = GL_FALSE;
+  uint64_t key;
+  FILE *f;
+
+  if (!supported())
+    return 0;
+  key = cache_key(sources, count);
+  cache_path(path, sizeof(path), key);
+  f = fopen(path, "rb");
+  if (!f)
+    return 0;
+  if (fread(&header, sizeof(header), 1, f) == 1 &&
+      header.magic == CACHE_MAGIC && header.key == key &&
+      header.length > 0 && header.length <= MAX_BINARY_SIZE) {
+    binary = malloc(header.length);
+    if (binary && fread(binary, header.length, 1, f) == 1) {
+      // Drop errors from before, a rejected binary is only an error
+      while (glGetError() != GL_NO_ERROR)
+        ;
+      program = glCreateProgram();
+      cache.ProgramBinary(program, header.format, binary, header.length);
+      if (glGetError() == GL_NO_ERROR)
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    }
+  }
+  fclose(f);
+  free(binary);
+
+  if (!linked) {
+    // Stale or corrupt, don't try it again
+    fprintf(stderr, "program cache: %s rejected, compiling from source\n",
+            path);
+    if (program)
+      glDeleteProgram(program);
+    unlink(path);
+    return 0;
+  }
+  return program;
+}
+
+void ProgramCacheStore(GLuint program, const char *const *sources, int count)
+{
+  char path[PATH_MAX + 32], tmp[PATH_MAX + 48];
+  struct cache_header header = { .magic = CACHE_MAGIC };
+  GLint length = 0;
+  GLsizei written = 0;
+  GLenum format;
+  void *binary;
+  FILE *f;
+  int fd;
+
+  if (!supported())
+    return;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+  if (length <= 0 || length > MAX_BINARY_SIZE)
+    return;
+  binary = malloc(length);
+  if (!binary)
+    return;
+  cache.GetProgramBinary(program, length, &written, &format, binary);
+  if (written <= 0) {
+    free(binary);
+    return;
+  }
+  header.format = format;
+  header.key = cache_key(sources, count);
+  header.length = written;
+
+  cache_path(path, sizeof(path), header.key);
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  fd = mkstemp(tmp);
+  f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!f) {
+    if (fd >= 0)
+      close(fd);
+    free(binary);
+    return;
+  }
+  if (fwrite(&header, sizeof(header), 1, f) == 1 &&
+      fwrite(binary, written, 1, f) == 1 && fclose(f) == 0)
+    rename(tmp, path);
+  else
+    unlink(tmp);
+  free(binary);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PROGCACHE_H
+#define PROGCACHE_H
+
+#include <GLES2/gl2.h>
+
+/*
+ * On-disk cache of linked program binaries (GL_OES_get_program_binary or
+ * OpenGL ES 3), keyed by a hash of the shader sources, GL_RENDERER and
+ * GL_VERSION. A driver or source change gives a new key, and a binary
+ * the driver rejects is removed, so callers just compile from source
+ * when ProgramCacheLoad() comes back empty.
+ */
+
+/*
+ * Keep binaries in dir, created if needed. A NULL dir means
+ * $XDG_CACHE_HOME/app or ~/.cache/app. Until then the cache is off.
+ */
+void ProgramCacheOpen(const char *dir, const char *app);
+
+/*
+ * Program linked from the cached binary of the count shader sources, or
+ * 0 when there is none or it doesn't link. Needs a current context.
+ */
+GLuint ProgramCacheLoad(const char *const *sources, int count);
+
+/* Save the binary of program, just linked from the count sources */
+void ProgramCacheStore(GLuint program, const char *const *sources, int count);
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The loader thread creates a context on the render thread's config,
+ * sharing its objects, and makes it current without a surface (or on a
+ * 1x1 pbuffer without EGL_KHR_surfaceless_context). It runs jobs in the
+ * order they were queued and finishes with glFinish(), so everything it
+ * made is complete before the render thread binds it.
+ *
+ * With KHR_parallel_shader_compile the render thread only issues the
+ * compiles, the driver's threads do the work. Without it they are loader
+ * jobs, so they don't hold up the render thread either.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+
+#include "progcache.h"
+#include "scenesetup.h"
+#include "startup.h"
+#include "trace.h"
+
+#define MAX_SETUP_PROGRAMS 8
+#define MAX_SETUP_JOBS 32
+/* Vertex and fragment shader, then the attribute names */
+#define MAX_PROGRAM_SOURCES 18
+
+struct setup_program {
+  GLuint *result;
+  GLuint program, shaders[2];
+  const char *sources[MAX_PROGRAM_SOURCES];
+  int count;
+  bool cached, linked;
+};
+
+/* Upload of data to *vbo, or a program compile when vbo is NULL */
+struct setup_job {
+  GLuint *vbo;
+  const void *data;
+  GLsizeiptr size;
+  struct setup_program *program;
+};
+
+struct scene_setup {
+  /* The loader thread and its context, when threaded */
+  bool threaded;
+  EGLDisplay dpy;
+  EGLConfig config;
+  EGLContext share, ctx;
+  EGLSurface surface;
+  EGLint client_version;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct setup_job jobs[MAX_SETUP_JOBS];
+  int queued, taken;
+  bool finishing;
+
+  /* Programs compile in the driver's threads */
+  bool parallel;
+  struct setup_program programs[MAX_SETUP_PROGRAMS];
+  int num_programs, compiling;
+};
+
+static __thread struct scene_setup setup;
+
+/* glMaxShaderCompilerThreadsKHR(), not in older gl2ext.h */
+typedef void (GL_APIENTRYP max_compiler_threads_proc)(GLuint count);
+
+static bool has_extension(const char *extensions, const char *name)
+{
+  size_t len = strlen(name);
+  const char *p = extensions;
+
+  while (p && (p = strstr(p, name))) {
+    if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || !p[len]))
+      return true;
+    p += len;
+  }
+  return false;
+}
+
+/* Start compiling and linking, the result is only asked for when needed */
+static void compile(struct setup_program *p)
+{
+  static const GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+  int i;
+
+  p->program = glCreateProgram();
+  for (i = 0; i < 2; i++) {
+    p->shaders[i] = glCreateShader(types[i]);
+    glShaderSource(p->shaders[i], 1, &p->sources[i], NULL);
+    glCompileShader(p->shaders[i]);
+    glAttachShader(p->program, p->shaders[i]);
+  }
+  for (i = 2; i < p->count; i++)
+    glBindAttribLocation(p->program, i - 2, p->sources[i]);
+  glLinkProgram(p->program);
+}
+
+static void run_job(const struct setup_job *job)
+{
+  uint64_t start = TraceNow();
+
+  if (!job->vbo) {
+    compile(job->program);
+    TraceSpan("compile", "setup", start);
+    return;
+  }
+  glGenBuffers(1, job->vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, *job->vbo);
+  glBufferData(GL_ARRAY_BUFFER, job->size, job->data, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  TraceSpan("upload", "setup", start);
+}
+
+/* Make a context sharing with s->share current, on the loader thread */
+static bool make_loader_current(struct scene_setup *s)
+{
+  static const EGLint pbuffer_attribs[] = {
+    EGL_WIDTH, 1,
+    EGL_HEIGHT, 1,
+    EGL_NONE
+  };
+  EGLint context_attribs[] = {
+    EGL_CONTEXT_CLIENT_VERSION, s->client_version,
+    EGL_NONE
+  };
+
+  s->surface = EGL_NO_SURFACE;
+  if (!has_extension(eglQueryString(s->dpy, EGL_EXTENSIONS),
+                     "EGL_KHR_surfaceless_context")) {
+    s->surface = eglCreatePbufferSurface(s->dpy, s->config, pbuffer_attribs);
+    if (s->surface == EGL_NO_SURFACE)
+      return false;
+  }
+  s->ctx = eglCreateContext(s->dpy, s->config, s->share, context_attribs);
+  if (s->ctx != EGL_NO_CONTEXT &&
+      eglMakeCurrent(s->dpy, s->surface, s->surface, s->ctx))
+    return true;
+  if (s->ctx != EGL_NO_CONTEXT)
+    eglDestroyContext(s->dpy, s->ctx);
+  if (s->surface != EGL_NO_SURFACE)
+    eglDestroySurface(s->dpy, s->surface);
+  return false;
+}
+
+static void *loader_thread(void *data)
+{
+  struct scene_setup *s = data;
+  struct setup_job *job;
+
+  TraceThreadName("loader");
+  // Jobs left behind are run by SceneSetupFinish()
+  if (!make_loader_current(s)) {
+    eglReleaseThread();
+    return NULL;
+  }
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    while (s->taken == s->queued && !s->finishing)
+      pthread_cond_wait(&s->cond, &s->lock);
+    job = s->taken < s->queued ? &s->jobs[s->taken++] : NULL;
+    pthread_mutex_unlock(&s->lock);
+    if (!job)
+      break;
+    run_job(job);
+  }
+  glFinish();
+  eglMakeCurrent(s->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(s->dpy, s->ctx);
+  if (s->surface != EGL_NO_SURFACE)
+    eglDestroySurface(s->dpy, s->surface);
+  eglReleaseThread();
+  return NULL;
+}
+
+/*
+ * Start the loader thread for the current context. The thread creates
+ * its own context, which is slow enough to be worth keeping off the
+ * render thread.
+ */
+static bool start_loader(struct scene_setup *s)
+{
+  EGLint config_attribs[] = { EGL_CONFIG_ID, 0, EGL_NONE };
+  EGLint n;
+
+  // Nothing to overlap with on a single CPU, it only adds a context
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    return false;
+  s->dpy = eglGetCurrentDisplay();
+  s->share = eglGetCurrentContext();
+  if (s->share == EGL_NO_CONTEXT ||
+      !eglQueryContext(s->dpy, s->share, EGL_CONFIG_ID, &config_attribs[1]) ||
+      !eglQueryContext(s->dpy, s->share, EGL_CONTEXT_CLIENT_VERSION,
+                       &s->client_version) ||
+      !eglChooseConfig(s->dpy, config_attribs, &s->config, 1, &n) || n < 1)
+    return false;
+
+  s->queued = s->taken = 0;
+  s->finishing = false;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  if (pthread_create(&s->thread, NULL, loader_thread, s) != 0) {
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    return false;
+  }
+  return true;
+}
+
+/* Hand job to the loader thread, or run it now if there is none */
+static void queue_job(const struct setup_job *job)
+{
+  bool queued = false;
+
+  if (setup.threaded) {
+    pthread_mutex_lock(&setup.lock);
+    if (setup.queued < MAX_SETUP_JOBS) {
+      setup.jobs[setup.queued++] = *job;
+      pthread_cond_signal(&setup.cond);
+      queued = true;
+    }
+    pthread_mutex_unlock(&setup.lock);
+  }
+  if (!queued)
+    run_job(job);
+}
+
+void SceneSetupBegin(void)
+{
+  const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+  max_compiler_threads_proc max_compiler_threads = NULL;
+
+  StartupBegin("scene setup");
+  setup.num_programs = setup.compiling = 0;
+  if (has_extension(extensions, "GL_KHR_parallel_shader_compile"))
+    max_compiler_threads = (max_compiler_threads_proc)
+        eglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+  setup.parallel = max_compiler_threads != NULL;
+  if (setup.parallel)
+    max_compiler_threads(0xffffffff);
+  setup.threaded = start_loader(&setup);
+}
+
+void SceneSetupProgram(GLuint *program, const char *vertex,
+                       const char *fragment, const char *const *attribs)
+{
+  struct setup_program *p;
+  struct setup_job job = { 0 };
+
+  assert(setup.num_programs < MAX_SETUP_PROGRAMS);
+  p = &setup.programs[setup.num_programs++];
+  memset(p, 0, sizeof(*p));
+  p->result = program;
+  p->sources[p->count++] = vertex;
+  p->sources[p->count++] = fragment;
+  while (attribs && *attribs) {
+    assert(p->count < MAX_PROGRAM_SOURCES);
+    p->sources[p->count++] = *attribs++;
+  }
+
+  // The attribute names are hashed too, the binary has their bindings
+  StartupBegin("program cache load");
+  p->program = ProgramCacheLoad(p->sources, p->count);
+  StartupEnd("program cache load");
+  p->cached = p->program != 0;
+  if (p->cached)
+    return;
+
+  if (!setup.compiling++)
+    StartupBegin("shader compile/link");
+  if (setup.parallel) {
+    compile(p);
+    return;
+  }
+  job.program = p;
+  queue_job(&job);
+}
+
+void SceneSetupUpload(GLuint *vbo, const void *data, GLsizeiptr size)
+{
+  struct setup_job job = { .vbo = vbo, .data = data, .size = size };
+
+  queue_job(&job);
+}
+
+bool SceneSetupFinish(void)
+{
+  bool ok = true;
+  int i, j;
+
+  if (setup.threaded) {
+    StartupBegin("loader wait");
+    pthread_mutex_lock(&setup.lock);
+    setup.finishing = true;
+    pthread_cond_signal(&setup.cond);
+    pthread_mutex_unlock(&setup.lock);
+    pthread_join(setup.thread, NULL);
+    // Left behind if the loader couldn't make its context current
+    while (setup.taken < setup.queued)
+      run_job(&setup.jobs[setup.taken++]);
+    StartupEnd("loader wait");
+
+    pthread_cond_destroy(&setup.cond);
+    pthread_mutex_destroy(&setup.lock);
+    setup.threaded = false;
+  }
+
+  for (i = 0; i < setup.num_programs; i++) {
+    struct setup_program *p = &setup.programs[i];
+    GLint linked = GL_FALSE;
+    char log[512];
+
+    glGetProgramiv(p->program, GL_LINK_STATUS, &linked);
+    p->linked = linked;
+    if (!linked) {
+      for (j = 0; j < 2 && p->shaders[j]; j++) {
+        glGetShaderInfoLog(p->shaders[j], sizeof(log), NULL, log);
+        if (*log)
+          fprintf(stderr, "shader %d of program %d: %s\n", j, i, log);
+      }
+      glGetProgramInfoLog(p->program, sizeof(log), NULL, log);
+      fprintf(stderr, "program %d failed to link: %s\n", i, log);
+      ok = false;
+    }
+    // The shaders go away with the program
+    for (j = 0; j < 2; j++)
+      if (p->shaders[j])
+        glDeleteShader(p->shaders[j]);
+    *p->result = p->program;
+  }
+  if (setup.compiling)
+    StartupEnd("shader compile/link");
+
+  for (i = 0; i < setup.num_programs; i++) {
+    struct setup_program *p = &setup.programs[i];
+
+    if (p->cached || !p->linked)
+      continue;
+    StartupBegin("program binary store");
+    ProgramCacheStore(p->program, p->sources, p->count);
+    StartupEnd("program binary store");
+  }
+  StartupEnd("scene setup");
+  return ok;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SCENESETUP_H
+#define SCENESETUP_H
+
+#include <stdbool.h>
+
+#include <GLES2/gl2.h>
+
+/*
+ * Scene setup pipeline that overlaps the slow parts of building a scene.
+ * Between SceneSetupBegin() and SceneSetupFinish() the render thread
+ * builds its meshes on the CPU while
+ *  - programs compile in the driver's threads (KHR_parallel_shader_compile)
+ *    or else on the loader thread, unless the program cache has them, and
+ *  - finished meshes are uploaded by the loader thread, through a context
+ *    sharing objects with the render thread's.
+ * Without a context for the loader thread, or on a single CPU, everything
+ * runs inline. Each render thread has its own pipeline, the calls need
+ * its context current.
+ */
+void SceneSetupBegin(void);
+
+/*
+ * Build a program from a vertex and a fragment shader, with the NULL
+ * terminated attribs bound to locations 0, 1, ... *program is set by
+ * SceneSetupFinish().
+ */
+void SceneSetupProgram(GLuint *program, const char *vertex,
+                       const char *fragment, const char *const *attribs);
+
+/*
+ * Upload size bytes of data into a new GL_ARRAY_BUFFER, *vbo. data must
+ * stay put until SceneSetupFinish().
+ */
+void SceneSetupUpload(GLuint *vbo, const void *data, GLsizeiptr size);
+
+/*
+ * Wait for the programs and uploads, which are then usable on the render
+ * thread. Returns false if a program failed to link, its log goes to
+ * stderr.
+ */
+bool SceneSetupFinish(void);
+
+#endif
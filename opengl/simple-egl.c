@@ -38,6 +38,7 @@
 #include <math.h>
 #include <assert.h>
 #include <signal.h>
+#include <stdatomic.h>
 
 #include <linux/input.h>
 
@@ -46,30 +47,110 @@
 #include <wayland-cursor.h>
 
 #if GLES==2
-#include <GLES2/gl2.h>
+#include <GLES3/gl3.h>
 #else
 #include <GLES/gl.h>
 #endif
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
+#ifdef HAVE_GBM
+#include <gbm.h>
+#endif
 
+#include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "clcompare.h"
+#include "golden.h"
+#include "histogram.h"
+#include "imgcompare.h"
+#include "metrics.h"
+#include "perfcount.h"
+#include "phasetimer.h"
+#include "present.h"
+#include "soak.h"
+#include "startup.h"
+#include "telemetry.h"
+#include "trace.h"
+#if GLES==2
+#include "glcompare.h"
+#include "progcache.h"
+#endif
+
+/* Default render size, -size overrides it */
 #define WINDOW_WIDTH 600
 #define WINDOW_HEIGHT 600
 #define GOLDEN_IMG_DIR "/home/mendel/golden_images"
 #define NUM_GOLDEN_IMAGES 10
+/* Animation time between default golden checkpoints, in seconds */
+#define CHECKPOINT_INTERVAL 1.0
+/* Animation time advanced per frame, in seconds */
+#define ANIMATION_STEP 0.01666
+/* Seconds between frame time reports */
+#define REPORT_INTERVAL 5.0
+/* Default frame time budget, in milliseconds */
+#define FRAME_BUDGET (1000.0 / 60.0)
+/* Readbacks in flight before CheckFrame has to wait for a free slot */
+#define READBACK_SLOTS 4
+/* Frames the GPU may fall behind by when there is no swap to throttle */
+#define HEADLESS_FRAMES 2
+/* Seconds per configuration when -sweep has no -duration or -frames */
+#define SWEEP_DURATION 5.0
+#define DEFAULT_RENDER_NODE "/dev/dri/renderD128"
 
 static bool test = false;
 static bool generate_ref_images = false;
+static bool sync_readback = false;
+/* Per-channel (RGBA) difference a golden pixel may have and still match */
+static uint8_t tolerance[4];
+/* Number of pixels outside the tolerance before a frame fails */
+static uint64_t max_bad_pixels = 0;
+
+/*
+ * Golden checkpoints are keyed on animation time rather than on frame
+ * numbers. The gears ask for the scene time with AnimationTime(); the
+ * frame that reaches a checkpoint is rendered exactly at its time, so the
+ * same scene states are compared whatever the frame rate or swap interval.
+ * -test takes the schedule from the golden archive.
+ */
+static double *checkpoint_times;
+static int num_checkpoints, next_checkpoint;
+static bool checkpoint_due;
+static double animation_time, animation_step = ANIMATION_STEP;
 static char *AppName;
+static volatile sig_atomic_t running = 1;
 
 struct window;
 
+/*
+ * Where frames go. The headless backends need no compositor: surfaceless
+ * and gbm render into an FBO, pbuffer into an EGL pbuffer surface (GLES1
+ * has no FBOs, so it always uses a pbuffer).
+ */
+enum backend {
+  BACKEND_WAYLAND,
+  BACKEND_SURFACELESS,  /* EGL_MESA_platform_surfaceless */
+  BACKEND_PBUFFER,
+  BACKEND_GBM,          /* GBM device on a DRM render node */
+};
+
+static const char *backend_names[] = {
+  "wayland", "surfaceless", "pbuffer", "gbm",
+};
+
 struct display {
+  enum backend backend;
+  const char *render_node;
+#ifdef HAVE_GBM
+  struct gbm_device *gbm;
+#endif
+  int render_fd;
   struct wl_display *display;
   struct wl_registry *registry;
   struct wl_compositor *compositor;
@@ -100,7 +181,28 @@ struct window {
   struct wl_surface *surface;
   EGLSurface egl_surface;
   int fullscreen, maximized, opaque, buffer_size, frame_sync, delay;
+  int depth_size;
   bool wait_for_configure;
+  /* Headless rendering target when there is no EGL surface */
+  GLuint fbo, color_rb, depth_rb;
+#if GLES==2
+  GLsync fences[HEADLESS_FRAMES];
+  int next_fence;
+  bool use_fences;
+#endif
+  /* Render thread of the window, 0 is the main thread (-contexts) */
+  int index;
+  /* Trace label of that thread, the trace keeps pointing at it */
+  char name[32];
+  EGLContext ctx;
+  /*
+   * Run of an extra context, which has its own warmup and ends when the
+   * main thread's run does. Only frames_done is read by other threads.
+   */
+  struct histogram run_frames;
+  double warmup_end, run_start, run_end, last_frame, animation_time;
+  atomic_uint frames_done;
+  unsigned interval_frames0;
 };
 
 extern void RunGears(void *);
@@ -109,92 +211,1065 @@ extern void RunGears(void *);
 static double
     current_time(void)
 {
-  struct timeval tv;
-  (void) gettimeofday(&tv, NULL );
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  return (double) tv.tv_sec + tv.tv_usec / 1000000.0;
+  return (double) ts.tv_sec + ts.tv_nsec / 1000000000.0;
 }
 
-static struct window *glwindow;
-static GLubyte pixeldata[WINDOW_WIDTH * WINDOW_HEIGHT * 4];
-static GLubyte golden_image_data[WINDOW_WIDTH * WINDOW_HEIGHT * 4];
-void CheckFrame(int frame) {
-  // This is a bit ugly and should be threaded, but for the purpose of
-  // this testing it's okay
-  FILE *fp;
-  char filename[50];
-  int size;
-  sprintf(filename, "%s/%s_frame%d", GOLDEN_IMG_DIR, AppName, frame);
+/*
+ * Frame to frame times, for the current report interval and for the whole
+ * run. Averages hide stutter, so the reports give percentiles, the frames
+ * over budget and the jitter (standard deviation) of the frame time.
+ */
+static struct histogram interval_frames, run_frames;
+static double frame_budget = FRAME_BUDGET;
+static FILE *stats_json;
+/* Thermal/cpufreq sampling period in seconds, 0 when off */
+static double telemetry_period;
+/* -soak sampling period in seconds and allowed memory growth in MB */
+static double soak_period, soak_max_growth = 64.0;
+static bool soak_recycle;
+
+static void ReportFrameTimes(const char *label, struct histogram *histogram,
+                             double seconds, FILE *json)
+{
+  struct histogram_stats st;
+  uint64_t over = HistogramCountAbove(histogram, frame_budget * 1000000.0);
+
+  HistogramStats(histogram, &st);
+  if (MetricsEnabled()) {
+    double values[] = { st.count, st.count / seconds, st.p50 / 1e6,
+                        st.p90 / 1e6, st.p99 / 1e6, st.p999 / 1e6,
+                        st.max / 1e6 };
+    MetricsPublish(METRICS_FRAME_TIMES, label, values, 7);
+  }
+  printf("%s frame time ms: p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f, "
+         "%llu over %.2f ms budget, jitter %.2f ms\n", label, st.p50 / 1e6,
+         st.p90 / 1e6, st.p99 / 1e6, st.p999 / 1e6, st.max / 1e6,
+         (unsigned long long) over, frame_budget, st.stddev / 1e6);
+  if (json) {
+    fprintf(json, "{\"report\":\"%s\",\"t\":%.3f,\"seconds\":%.3f,"
+            "\"frames\":%llu,\"fps\":%.3f,\"p50_ms\":%.3f,"
+            "\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"p99_9_ms\":%.3f,"
+            "\"max_ms\":%.3f,\"mean_ms\":%.3f,\"jitter_ms\":%.3f,"
+            "\"budget_ms\":%.3f,\"over_budget\":%llu}\n", label,
+            current_time(), seconds,
+            (unsigned long long) st.count, st.count / seconds, st.p50 / 1e6,
+            st.p90 / 1e6, st.p99 / 1e6, st.p999 / 1e6, st.max / 1e6,
+            st.mean / 1e6, st.stddev / 1e6, frame_budget,
+            (unsigned long long) over);
+    fflush(json);
+  }
+}
+
+/* Window of the calling render thread */
+static __thread struct window *glwindow;
+static struct golden_archive *golden_archive;
+static struct golden_writer *golden_writer;
+/* Tile hashes of the frame being checked */
+static uint64_t *tile_hashes;
+/* Per-tile results when the diff runs on an OpenCL device */
+static bool use_cl_compare;
+static enum cl_compare_device cl_compare_device;
+static struct img_diff *cl_tiles;
+/*
+ * -gpu-compare diffs on the GPU against golden textures, only per-tile
+ * results are read back and only when the occlusion query saw a mismatch
+ */
+static bool use_gpu_compare;
+/* CPU time the checker spent comparing, to judge offloading */
+static double compare_cpu_time;
+/* Frames are read back for golden checkpoints and/or -capture */
+static bool readback;
+
+/*
+ * -capture streams every capture_every'th frame to a Y4M file. Capture
+ * frames share the readback ring with the checkpoints but never wait for
+ * it: when no slot is free the frame is dropped and counted instead.
+ */
+static const char *capture_path;
+static int capture_every = 1;
+static struct capture *capture;
+static int captured_frames, dropped_frames;
+
+/*
+ * Frame sized buffers (readback copies, tile hashes, the golden decode
+ * frame and the golden writer's pool) are carved out of one cache line
+ * aligned allocation made once the render size is known, so large sizes
+ * like 4K don't depend on static arrays or per-frame mallocs.
+ */
+#define ARENA_ALIGN 64
+
+static struct {
+  uint8_t *base;
+  size_t size, used;
+} arena;
+
+static void InitArena(size_t size)
+{
+  if (posix_memalign((void **) &arena.base, ARENA_ALIGN, size) != 0) {
+    fprintf(stderr, "could not allocate %zu bytes for frame buffers\n", size);
+    exit(EXIT_FAILURE);
+  }
+  arena.size = size;
+  arena.used = 0;
+}
+
+static void *ArenaAlloc(size_t size)
+{
+  void *p = arena.base + arena.used;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  assert(arena.used + size <= arena.size);
+  arena.used += size;
+  return p;
+}
+
+void GetFrameSize(int *width, int *height)
+{
+  *width = glwindow->geometry.width;
+  *height = glwindow->geometry.height;
+}
+
+/*
+ * Golden frames are read back asynchronously. On GLES3 each slot owns a
+ * pixel buffer object: CheckFrame() queues glReadPixels into it and drops
+ * a fence, and later frames map the buffer once the fence has signalled.
+ * Without PBOs (GLES1, GLES2-only drivers, -sync-readback) the slot holds
+ * a plain buffer that glReadPixels fills synchronously. Either way the
+ * pixels are handed to the checker thread for compare/write, and the slot
+ * is recycled once the checker is done with it.
+ */
+enum slot_state {
+  SLOT_FREE,
+  SLOT_PENDING,   /* readback queued, waiting for the fence */
+  SLOT_BUSY,      /* pixels owned by the checker thread */
+};
+
+struct readback_slot {
+  enum slot_state state;
+  int frame;
+  double time;      /* animation time of the checkpoint */
+  bool capture;     /* destined for the capture file, not the checker */
+  GLubyte *pixels;
+  GLubyte *buffer;  /* CPU copy target when not using a PBO */
+#if GLES==2
+  GLuint pbo;
+  GLsync fence;
+  GLuint result_pbo, query;  /* -gpu-compare checkpoints */
+#endif
+  bool done;        /* set by the checker, protected by checker.lock */
+};
+
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake, done;
+  struct readback_slot *queue[READBACK_SLOTS];
+  int head, count;
+  /* Set when a checkpoint decided the outcome of the run */
+  bool finished;
+  int exit_code;
+  char message[1024];
+} checker = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+static struct readback_slot slots[READBACK_SLOTS];
+static int next_slot;
+#if GLES==2
+static bool use_pbo;
+#endif
+/* Time the render thread spent in CheckFrame, for the FPS report */
+static double readback_time;
+
+static void Finish(int exit_code, const char *message)
+{
+  pthread_mutex_lock(&checker.lock);
+  if (!checker.finished) {
+    checker.finished = true;
+    checker.exit_code = exit_code;
+    snprintf(checker.message, sizeof(checker.message), "%s", message);
+  }
+  pthread_mutex_unlock(&checker.lock);
+}
+
+/* Tiles listed by name in a mismatch report */
+#define MAX_REPORTED_TILES 8
+
+/*
+ * Compare a frame against golden checkpoint n. Only tiles whose hash
+ * differs from the archived one are diffed, so the golden frame is not
+ * even decoded when everything matches. With -gpu-compare pixeldata holds
+ * the per-tile results of the GPU diff instead, or is NULL when no pixel
+ * differed. The diverging tiles are described in regions. Returns -1 if
+ * the archive could not be read.
+ */
+static int CompareGolden(int n, const GLubyte *pixeldata,
+                         struct img_diff *diff, char *regions, size_t size)
+{
+  const int width = glwindow->geometry.width;
+  const int height = glwindow->geometry.height;
+  const int tile_size = GoldenArchiveTileSize(golden_archive);
+  const int tiles_x = (width + tile_size - 1) / tile_size;
+  const int tiles = GoldenTileCount(width, height, tile_size);
+  const uint64_t *golden_hashes = GoldenArchiveTileHashes(golden_archive, n);
+  const GLubyte *golden_image_data = NULL;
+  int bad_tiles = 0, len = 0;
+
+  if (!golden_hashes)
+    return -1;
+  if (!use_gpu_compare)
+    GoldenTileHashes(pixeldata, width, height, tile_size,
+                     tile_hashes);
+
+  memset(diff, 0, sizeof(*diff));
+  diff->x0 = width;
+  diff->y0 = height;
+  diff->x1 = diff->y1 = -1;
+  regions[0] = '\0';
+
+  for (int i = 0; i < tiles; i++) {
+    int x = (i % tiles_x) * tile_size, y = (i / tiles_x) * tile_size;
+    int w = width - x < tile_size ? width - x : tile_size;
+    int h = height - y < tile_size ? height - y : tile_size;
+    struct img_diff tile;
+
+#if GLES==2
+    if (use_gpu_compare) {
+      // Nothing was read back when the query saw no differing pixel
+      if (!pixeldata)
+        break;
+      GlCompareTile(pixeldata, i, x, y, &tile);
+    } else
+#endif
+    {
+      if (tile_hashes[i] == golden_hashes[i])
+        continue;
+      if (!golden_image_data) {
+        golden_image_data = GoldenArchiveFrame(golden_archive, n);
+        if (!golden_image_data)
+          return -1;
+        // One device pass diffs every tile, the loop picks the results
+        if (use_cl_compare &&
+            ClCompareTiles(golden_image_data, pixeldata, tolerance,
+                           cl_tiles) < 0)
+          use_cl_compare = false;
+      }
+
+      if (use_cl_compare)
+        tile = cl_tiles[i];
+      else
+        CompareImageRegion(golden_image_data, pixeldata, width * 4,
+                           x, y, w, h, tolerance, &tile);
+    }
+    diff->sse += tile.sse;
+    if (tile.max_delta > diff->max_delta)
+      diff->max_delta = tile.max_delta;
+    if (!tile.bad_pixels)
+      continue;
+
+    diff->bad_pixels += tile.bad_pixels;
+    if (tile.x0 < diff->x0) diff->x0 = tile.x0;
+    if (tile.y0 < diff->y0) diff->y0 = tile.y0;
+    if (tile.x1 > diff->x1) diff->x1 = tile.x1;
+    if (tile.y1 > diff->y1) diff->y1 = tile.y1;
+
+    if (bad_tiles++ < MAX_REPORTED_TILES && len < size)
+      len += snprintf(regions + len, size - len, " %dx%d+%d+%d:%llu",
+                      w, h, x, y, (unsigned long long) tile.bad_pixels);
+  }
+  if (bad_tiles > MAX_REPORTED_TILES && len < size)
+    snprintf(regions + len, size - len, " and %d more tiles",
+             bad_tiles - MAX_REPORTED_TILES);
+
+  diff->psnr = diff->sse ? 10.0 * log10(255.0 * 255.0 * 4.0 * width *
+                                        height / diff->sse)
+                         : INFINITY;
+  return 0;
+}
+
+/* Compare or save one golden frame, runs on the checker thread */
+static void ProcessFrame(int frame, double time, const GLubyte *pixeldata)
+{
+  char message[1024];
+  char regions[512];
+  struct img_diff diff;
+  struct timespec t0, t1;
+  int ret;
 
-  // Read the framebuffer
-  glReadPixels(0, 0, glwindow->geometry.width,
-               glwindow->geometry.height,
-               GL_RGBA,
-               GL_UNSIGNED_BYTE,
-               pixeldata);
   if (test) {
-    // Compare the current frame with a saved golden image
-    fp = fopen(filename, "r");
-    if (fp == 0) {
-      if (frame == 0) {
-        printf("FAIL : No golden images to compare with\n");
-        exit(1);
-      } else {
-        printf("PASS : All %d frames identical to golden images\n", frame - 1);
-        exit(0);
+    // Compare the current frame with the archived golden image
+    uint64_t start = TraceNow();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    ret = CompareGolden(frame, pixeldata, &diff, regions, sizeof(regions));
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    TraceSpan("compare", "golden", start);
+    compare_cpu_time += (t1.tv_sec - t0.tv_sec) +
+                        (t1.tv_nsec - t0.tv_nsec) / 1000000000.0;
+    if (ret < 0) {
+      Finish(1, "FAIL : golden image archive is corrupt");
+      return;
+    }
+    if (MetricsEnabled()) {
+      double values[] = { frame, diff.bad_pixels <= max_bad_pixels,
+                          diff.bad_pixels, diff.max_delta, diff.psnr };
+      MetricsPublish(METRICS_CHECK, "golden", values, 5);
+      MetricsAdd(METRIC_CHECKS, 1);
+      if (diff.bad_pixels > max_bad_pixels)
+        MetricsAdd(METRIC_FAILED_CHECKS, 1);
+    }
+    if (diff.bad_pixels > max_bad_pixels) {
+      snprintf(message, sizeof(message),
+               "FAIL : golden image mismatch frame: %d (%llu bad pixels, "
+               "max delta %u, PSNR %.2f dB, region %d,%d-%d,%d)\n"
+               "       diverging tiles (WxH+X+Y:bad pixels):%s", frame,
+               (unsigned long long) diff.bad_pixels, diff.max_delta,
+               diff.psnr, diff.x0, diff.y0, diff.x1, diff.y1, regions);
+      Finish(1, message);
+      return;
+    }
+    if (diff.max_delta)
+      printf("frame %d within tolerance: %llu bad pixels, max delta %u, "
+             "PSNR %.2f dB\n", frame, (unsigned long long) diff.bad_pixels,
+             diff.max_delta, diff.psnr);
+    if (frame == num_checkpoints - 1) {
+      snprintf(message, sizeof(message),
+               "PASS : All %d frames identical to golden images\n"
+               "       compare: %.3f ms checker CPU per frame on %s",
+               num_checkpoints, compare_cpu_time * 1000.0 / num_checkpoints,
+               use_gpu_compare ? "GPU diff pass" :
+               use_cl_compare ? ClCompareDevice() : CompareImagesImpl());
+      Finish(0, message);
+    }
+  } else if (generate_ref_images) {
+    // Append the frame to the golden image archive
+    uint64_t start = TraceNow();
+    if (GoldenWriterAdd(golden_writer, pixeldata, time) < 0) {
+      Finish(1, "FAIL : could not write golden image");
+      return;
+    }
+    TraceSpan("write golden", "golden", start);
+    if (frame == num_checkpoints - 1) {
+      if (GoldenWriterClose(golden_writer) < 0)
+        Finish(1, "FAIL : could not write golden image archive");
+      else
+        Finish(1, "Done generating golden images, exiting");
+    }
+  }
+}
+
+static void *CheckerThread(void *arg)
+{
+  struct readback_slot *slot;
+  bool finished;
+
+  // Checks the frames of the main thread's window
+  glwindow = arg;
+  TraceThreadName("checker");
+  pthread_mutex_lock(&checker.lock);
+  while (1) {
+    while (checker.count == 0)
+      pthread_cond_wait(&checker.wake, &checker.lock);
+    slot = checker.queue[checker.head];
+    checker.head = (checker.head + 1) % READBACK_SLOTS;
+    checker.count--;
+    finished = checker.finished;
+    pthread_mutex_unlock(&checker.lock);
+
+    if (slot->capture) {
+      uint64_t start = TraceNow();
+      if (CaptureWriteFrame(capture, slot->pixels) < 0)
+        Finish(1, "FAIL : could not write capture file");
+      TraceSpan("write capture", "capture", start);
+    } else if (!finished) {
+      ProcessFrame(slot->frame, slot->time, slot->pixels);
+    }
+
+    pthread_mutex_lock(&checker.lock);
+    slot->done = true;
+    pthread_cond_broadcast(&checker.done);
+  }
+  return NULL;
+}
+
+static void SubmitSlot(struct readback_slot *slot)
+{
+  slot->state = SLOT_BUSY;
+  pthread_mutex_lock(&checker.lock);
+  slot->done = false;
+  checker.queue[(checker.head + checker.count) % READBACK_SLOTS] = slot;
+  checker.count++;
+  pthread_cond_signal(&checker.wake);
+  pthread_mutex_unlock(&checker.lock);
+}
+
+/* Stage golden checkpoint n for the GPU diff pass ahead of its frame */
+static void UploadGolden(int n)
+{
+#if GLES==2
+  const uint8_t *golden_image_data = GoldenArchiveFrame(golden_archive, n);
+
+  if (!golden_image_data)
+    Finish(1, "FAIL : golden image archive is corrupt");
+  else
+    GlCompareSetGolden(golden_image_data);
+#endif
+}
+
+#if GLES==2
+/*
+ * Map the buffer a slot was read back into: the per-tile results for
+ * -gpu-compare checkpoints, the full frame otherwise
+ */
+static GLubyte *MapSlot(struct readback_slot *slot)
+{
+  GLuint pbo = slot->pbo;
+  GLsizeiptr size = (GLsizeiptr) glwindow->geometry.width *
+                    glwindow->geometry.height * 4;
+  GLubyte *pixels;
+
+  if (use_gpu_compare && !slot->capture) {
+    GLuint any_samples;
+    // Identical frames pass no fragment, don't even map the results
+    glGetQueryObjectuiv(slot->query, GL_QUERY_RESULT, &any_samples);
+    if (!any_samples)
+      return NULL;
+    pbo = slot->result_pbo;
+    size = GlCompareResultSize();
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  return pixels;
+}
+#endif
+
+/* Arena space InitReadback() carves out, whichever path it takes */
+static size_t ReadbackArenaSize(void)
+{
+  size_t size = (size_t) glwindow->geometry.width *
+                glwindow->geometry.height * 4;
+  size_t tiles = GoldenTileCount(glwindow->geometry.width,
+                                 glwindow->geometry.height, GOLDEN_TILE_SIZE);
+
+  return READBACK_SLOTS * (size + ARENA_ALIGN) +
+         tiles * (sizeof(*tile_hashes) + sizeof(*cl_tiles)) +
+         2 * ARENA_ALIGN;
+}
+
+static void InitReadback(void)
+{
+  size_t size = (size_t) glwindow->geometry.width *
+                glwindow->geometry.height * 4;
+  size_t hashes = GoldenTileCount(glwindow->geometry.width,
+                                  glwindow->geometry.height,
+                                  GOLDEN_TILE_SIZE) * sizeof(*tile_hashes);
+  int i;
+
+  use_gpu_compare = use_gpu_compare && test;
+#if GLES==2
+  const char *version = (const char *) glGetString(GL_VERSION);
+  use_pbo = !sync_readback && version &&
+      strncmp(version, "OpenGL ES 3", 11) == 0;
+  if (use_gpu_compare && !use_pbo)
+    fprintf(stderr, "GPU compare needs OpenGL ES 3 pixel buffers, "
+            "comparing on the CPU\n");
+  use_gpu_compare = use_gpu_compare && use_pbo &&
+      GlCompareInit(glwindow->geometry.width, glwindow->geometry.height,
+                    GOLDEN_TILE_SIZE);
+#else
+  if (use_gpu_compare)
+    fprintf(stderr, "GPU compare needs OpenGL ES 3, comparing on the CPU\n");
+  use_gpu_compare = false;
+#endif
+  size_t tiles = GoldenTileCount(glwindow->geometry.width,
+                                 glwindow->geometry.height,
+                                 GOLDEN_TILE_SIZE) * sizeof(*cl_tiles);
+
+  tile_hashes = ArenaAlloc(hashes);
+  cl_tiles = ArenaAlloc(tiles);
+  for (i = 0; i < READBACK_SLOTS; i++) {
+#if GLES==2
+    if (use_pbo) {
+      if (use_gpu_compare) {
+        glGenQueries(1, &slots[i].query);
+        glGenBuffers(1, &slots[i].result_pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].result_pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, GlCompareResultSize(), NULL,
+                     GL_STREAM_READ);
       }
+      // Full frames are still needed for captures
+      if (!use_gpu_compare || capture) {
+        glGenBuffers(1, &slots[i].pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+      }
+      continue;
     }
-    size = fread(golden_image_data, 4,
-                 sizeof(golden_image_data)/4, fp);
-    if (size != sizeof(golden_image_data)/4) {
-      printf("FAIL : golden image has wrong size\n");
-      fclose(fp);
-      exit(1);
+#endif
+    slots[i].buffer = ArenaAlloc(size);
+  }
+#if GLES==2
+  if (use_pbo)
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+#endif
+  pthread_create(&checker.thread, NULL, CheckerThread, glwindow);
+  if (use_gpu_compare)
+    UploadGolden(0);
+}
+
+/*
+ * Move finished readbacks along: hand signalled PBOs to the checker, in
+ * frame order, and recycle slots the checker is done with. With wait set
+ * this blocks until at least one slot is free.
+ */
+static void PollReadback(bool wait)
+{
+  int i;
+
+  do {
+#if GLES==2
+    for (i = 0; i < READBACK_SLOTS; i++) {
+      struct readback_slot *slot = &slots[(next_slot + i) % READBACK_SLOTS];
+
+      if (slot->state == SLOT_PENDING) {
+        GLenum status = glClientWaitSync(slot->fence,
+                                         wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                                         wait ? 1000000000 : 0);
+        if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+          break;  /* keep frame order, later slots wait for this one */
+        uint64_t start = TraceNow();
+        glDeleteSync(slot->fence);
+        slot->pixels = MapSlot(slot);
+        TraceSpan("map readback", "golden", start);
+        SubmitSlot(slot);
+      }
     }
-    for (int i = 0; i < sizeof(golden_image_data); i++) {
-      if (golden_image_data[i] != pixeldata[i]) {
-        printf("FAIL : golden image mismatch frame: %d\n", frame);
-        fclose(fp);
-        exit(1);
+#endif
+
+    pthread_mutex_lock(&checker.lock);
+    if (wait) {
+      bool busy = true;
+      for (i = 0; i < READBACK_SLOTS; i++)
+        if (slots[i].state != SLOT_BUSY || slots[i].done)
+          busy = false;
+      if (busy)
+        pthread_cond_wait(&checker.done, &checker.lock);
+    }
+    for (i = 0; i < READBACK_SLOTS; i++) {
+      struct readback_slot *slot = &slots[i];
+      if (slot->state == SLOT_BUSY && slot->done) {
+#if GLES==2
+        if (use_pbo && slot->pixels) {
+          glBindBuffer(GL_PIXEL_PACK_BUFFER,
+                       use_gpu_compare && !slot->capture ? slot->result_pbo
+                                                         : slot->pbo);
+          glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+          glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+#endif
+        slot->state = SLOT_FREE;
       }
     }
-  } else if (generate_ref_images) {
-    // Save the frame as a golden image
-    fp = fopen(filename, "w");
-    fwrite(pixeldata, 4, sizeof(pixeldata)/4, fp);
-    fclose(fp);
-    if (frame == NUM_GOLDEN_IMAGES) {
-      printf("Done generating golden images, exiting\n");
-      exit(1);
+    pthread_mutex_unlock(&checker.lock);
+  } while (wait && slots[next_slot].state != SLOT_FREE);
+}
+
+/* Queue a readback of the current frame into the next slot */
+static void ReadFrame(struct readback_slot *slot)
+{
+  uint64_t start = TraceNow();
+
+#if GLES==2
+  if (use_pbo && use_gpu_compare && !slot->capture) {
+    // Diff on the GPU, only the per-tile results land in the PBO
+    GlCompareFrame(slot->query, slot->result_pbo, tolerance);
+    TraceSpan("queue compare", "golden", start);
+    slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot->state = SLOT_PENDING;
+    next_slot = (next_slot + 1) % READBACK_SLOTS;
+    return;
+  }
+  if (use_pbo) {
+    // Queue the readback into the PBO, it is mapped a few frames later
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+    glReadPixels(0, 0, glwindow->geometry.width,
+                 glwindow->geometry.height,
+                 GL_RGBA,
+                 GL_UNSIGNED_BYTE,
+                 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    TraceSpan("queue readback", "golden", start);
+    slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot->state = SLOT_PENDING;
+    next_slot = (next_slot + 1) % READBACK_SLOTS;
+    return;
+  }
+#endif
+
+  // Read the framebuffer
+  glReadPixels(0, 0, glwindow->geometry.width,
+               glwindow->geometry.height,
+               GL_RGBA,
+               GL_UNSIGNED_BYTE,
+               slot->buffer);
+  TraceSpan("readback", "golden", start);
+  slot->pixels = slot->buffer;
+  SubmitSlot(slot);
+  next_slot = (next_slot + 1) % READBACK_SLOTS;
+}
+
+void CheckFrame(int frame) {
+  struct readback_slot *slot = &slots[next_slot];
+
+  if (slot->state != SLOT_FREE)
+    PollReadback(true);
+  slot->frame = frame;
+  slot->time = checkpoint_times[frame];
+  slot->capture = false;
+  ReadFrame(slot);
+  if (use_gpu_compare && frame + 1 < num_checkpoints)
+    UploadGolden(frame + 1);
+
+  if (sync_readback) {
+    pthread_mutex_lock(&checker.lock);
+    while (!slot->done)
+      pthread_cond_wait(&checker.done, &checker.lock);
+    pthread_mutex_unlock(&checker.lock);
+  }
+}
+
+/* Queue frame for the capture file, or drop it if the ring is full */
+static void CaptureFrame(int frame)
+{
+  struct readback_slot *slot = &slots[next_slot];
+
+  if (slot->state != SLOT_FREE) {
+    dropped_frames++;
+    return;
+  }
+  slot->frame = frame;
+  slot->time = animation_time;
+  slot->capture = true;
+  ReadFrame(slot);
+  captured_frames++;
+}
+
+/*
+ * Hand over every outstanding readback and wait until the checker has
+ * processed them all, oldest first.
+ */
+static void FlushReadback(void)
+{
+  int i;
+
+#if GLES==2
+  if (use_pbo) {
+    for (i = 0; i < READBACK_SLOTS; i++)
+      while (slots[(next_slot + i) % READBACK_SLOTS].state == SLOT_PENDING)
+        PollReadback(true);
+  }
+#endif
+  pthread_mutex_lock(&checker.lock);
+  for (i = 0; i < READBACK_SLOTS; i++)
+    while (slots[i].state == SLOT_BUSY && !slots[i].done)
+      pthread_cond_wait(&checker.done, &checker.lock);
+  pthread_mutex_unlock(&checker.lock);
+  PollReadback(false);
+}
+
+/*
+ * Flush and close the capture file while the context is still current.
+ * Also registered with atexit() so the file is complete on any exit.
+ */
+static void StopCapture(void)
+{
+  if (!capture)
+    return;
+  FlushReadback();
+  if (CaptureClose(capture) < 0)
+    fprintf(stderr, "could not write capture file %s\n", capture_path);
+  else
+    printf("capture: %d frames written to %s, %d dropped\n",
+           captured_frames, capture_path, dropped_frames);
+  capture = NULL;
+}
+
+/*
+ * The checker reports -test and -golden runs after the last checkpoint and
+ * exits. Runs ending before that (Ctrl-C) still get the frames already
+ * queued checked, then fail unless those decided the run; an unfinished
+ * golden archive is dropped instead of leaving its temporary file behind.
+ * Returns false when the run failed.
+ */
+static bool StopChecks(void)
+{
+  bool finished;
+
+  if (!test && !golden_writer)
+    return true;
+  // The checker is done with the queued frames, and idle afterwards
+  FlushReadback();
+  pthread_mutex_lock(&checker.lock);
+  finished = checker.finished;
+  pthread_mutex_unlock(&checker.lock);
+  if (finished) {
+    printf("%s\n", checker.message);
+    return checker.exit_code == 0;
+  }
+  if (golden_writer) {
+    GoldenWriterAbort(golden_writer);
+    golden_writer = NULL;
+    printf("FAIL : run ended after %d of %d golden checkpoints, "
+           "no archive written\n", next_checkpoint, num_checkpoints);
+  } else {
+    printf("FAIL : run ended after %d of %d checkpoints\n",
+           next_checkpoint, num_checkpoints);
+  }
+  return false;
+}
+
+/* Scene time for the frame about to be drawn, in seconds */
+double AnimationTime(void) {
+  if (glwindow->index)
+    return glwindow->animation_time;
+  if (next_checkpoint < num_checkpoints &&
+      animation_time + 1e-9 >= checkpoint_times[next_checkpoint]) {
+    animation_time = checkpoint_times[next_checkpoint];
+    checkpoint_due = true;
+  }
+  return animation_time;
+}
+
+/*
+ * Benchmark bounds: the run starts after warmup seconds and, if set, ends
+ * after bench_frames frames or bench_duration seconds. Ctrl-C ends it too.
+ */
+static int bench_frames;
+static double bench_duration, warmup;
+static double run_start = -1.0, run_end;
+static int run_frame_count;
+/* Frame timing state of HandleFrame(), reset for each -sweep config */
+static double tRate0 = -1.0, tLast = -1.0, warmup_end = -1.0;
+
+/* Start over with a new run, the next frame starts the warmup */
+static void ResetRun(void)
+{
+  run_start = tRate0 = tLast = warmup_end = -1.0;
+  run_frame_count = 0;
+  HistogramReset(&run_frames);
+  HistogramReset(&interval_frames);
+}
+
+/*
+ * -contexts N renders the scene in N windows, each with its own context
+ * and render thread, to see how the driver and compositor scale. The main
+ * thread's window runs the full harness, the extra ones only count their
+ * frames.
+ */
+static int num_contexts = 1;
+static struct window *contexts;
+static pthread_t *context_threads;
+static atomic_bool stop_contexts;
+static bool contexts_running;
+
+/* Stop and join the extra render threads */
+static void StopContexts(void)
+{
+  int i;
+
+  if (!contexts_running)
+    return;
+  atomic_store(&stop_contexts, true);
+  for (i = 1; i < num_contexts; i++)
+    pthread_join(context_threads[i], NULL);
+  contexts_running = false;
+}
+
+/* Frame times and length of the run of context i */
+static double ContextStats(int i, struct histogram_stats *st)
+{
+  const struct window *w = &contexts[i];
+
+  HistogramStats(i ? &w->run_frames : &run_frames, st);
+  return i ? w->run_end - w->run_start : run_end - run_start;
+}
+
+/* Per context and aggregate frame rates, after StopContexts() */
+static void ReportContexts(FILE *json)
+{
+  struct histogram_stats st;
+  double seconds, fps, total = 0.0;
+  int i;
+
+  if (num_contexts < 2)
+    return;
+  for (i = 0; i < num_contexts; i++) {
+    seconds = ContextStats(i, &st);
+    fps = seconds > 0.0 ? st.count / seconds : 0.0;
+    total += fps;
+    printf("context %d: %llu frames in %3.1f seconds = %6.3f FPS, "
+           "p50 %.2f p99 %.2f ms\n", i, (unsigned long long) st.count,
+           seconds, fps, st.p50 / 1e6, st.p99 / 1e6);
+  }
+  printf("%d contexts: aggregate %6.3f FPS, %6.3f FPS per context\n",
+         num_contexts, total, total / num_contexts);
+  if (!json)
+    return;
+  fprintf(json, "{\"report\":\"run-contexts\",\"contexts\":%d,"
+          "\"aggregate_fps\":%.3f,\"per_context\":[", num_contexts, total);
+  for (i = 0; i < num_contexts; i++) {
+    seconds = ContextStats(i, &st);
+    fprintf(json, "%s{\"frames\":%llu,\"seconds\":%.3f,\"fps\":%.3f,"
+            "\"p50_ms\":%.3f,\"p99_ms\":%.3f}", i ? "," : "",
+            (unsigned long long) st.count, seconds,
+            seconds > 0.0 ? st.count / seconds : 0.0, st.p50 / 1e6,
+            st.p99 / 1e6);
+  }
+  fprintf(json, "]}\n");
+  fflush(json);
+}
+
+/*
+ * Summarize the whole run, once. Also registered with atexit() for runs
+ * ended by a test verdict. Bounded runs print the JSON summary to stdout
+ * unless -stats-json sends it elsewhere.
+ */
+static void ReportRun(void)
+{
+  static bool reported;
+  double seconds = run_end - run_start;
+  FILE *json = stats_json;
+  struct histogram_stats st;
+
+  StopContexts();
+  HistogramStats(&run_frames, &st);
+  if (reported || run_start < 0.0 || !st.count)
+    return;
+  reported = true;
+  if (!json && (bench_frames || bench_duration > 0.0))
+    json = stdout;
+  printf("%llu frames in %3.1f seconds = %6.3f FPS\n",
+         (unsigned long long) st.count, seconds, st.count / seconds);
+  ReportFrameTimes("run", &run_frames, seconds, json);
+  PhaseTimerReport("run", true, json);
+  PresentReport("run", true, json);
+  TelemetryReportRun("run", json);
+  SoakReport("run", json);
+  ReportContexts(json);
+  fflush(stdout);
+}
+
+/* Start of the frame being drawn, for the trace */
+static __thread uint64_t frame_trace_start;
+
+/*
+ * Called by the gears before each frame, true when they should tear down
+ * and rebuild their scene because a soak sample was just taken.
+ */
+int SoakRecycle(void) {
+  bool recycle = soak_recycle;
+
+  if (glwindow->index)
+    return 0;
+  soak_recycle = false;
+  return recycle;
+}
+
+/* Called by the gears right before drawing a frame */
+void BeginFrame(void) {
+  StartupBegin("first frame");
+  frame_trace_start = TraceNow();
+  if (!glwindow->index)
+    PhaseBegin(PHASE_DRAW);
+}
+
+/*
+ * Finish a frame of a headless backend. Nothing throttles such a loop,
+ * swapping a pbuffer is a no-op, so wait until the GPU is at most
+ * HEADLESS_FRAMES behind.
+ */
+static void
+    finish_headless_frame(struct window *window)
+{
+#if GLES==2
+  if (window->use_fences) {
+    GLsync *fence = &window->fences[window->next_fence];
+
+    if (*fence) {
+      glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+      glDeleteSync(*fence);
     }
+    *fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    window->next_fence = (window->next_fence + 1) % HEADLESS_FRAMES;
+    glFlush();
+    return;
   }
+#endif
+  glFinish();
 }
 
-void HandleFrame(void) {
-  static int frame0, frame = 0;
-  static double tRate0 = -1.0;
+static void
+    swap_buffers(struct window *window)
+{
+  // -delay stands in for work the client does before presenting
+  if (window->delay > 0)
+    usleep(window->delay);
+  if (window->egl_surface != EGL_NO_SURFACE)
+    eglSwapBuffers(window->display->egl.dpy, window->egl_surface);
+  if (window->display->backend != BACKEND_WAYLAND)
+    finish_headless_frame(window);
+}
+
+/* HandleFrame() of an extra context, only times and shows the frame */
+static int HandleContextFrame(struct window *window)
+{
   double t = current_time();
 
-  if (frame % 60 == 0) {
-    CheckFrame(frame/60);
+  if (window->warmup_end < 0.0)
+    window->warmup_end = t + warmup;
+  if (window->run_start >= 0.0) {
+    HistogramRecord(&window->run_frames,
+                    (uint64_t) ((t - window->last_frame) * 1000000000.0));
+    window->run_end = t;
+  } else if (t >= window->warmup_end) {
+    window->run_start = window->run_end = t;
+  }
+  window->last_frame = t;
+  MetricsAdd(METRIC_FRAMES, 1);
+  swap_buffers(window);
+  TraceSpan("frame", "frame", frame_trace_start);
+  atomic_fetch_add_explicit(&window->frames_done, 1, memory_order_relaxed);
+  window->animation_time += animation_step;
+  return running && !atomic_load(&stop_contexts);
+}
+
+/* Returns 0 once the gears should stop */
+int HandleFrame(void) {
+  static int frame0, frame = 0;
+  static double readback0;
+  double t;
+
+  if (glwindow->index)
+    return HandleContextFrame(glwindow);
+  t = current_time();
+
+  if (warmup_end < 0.0)
+    warmup_end = t + warmup;
+  if (tLast >= 0.0) {
+    uint64_t ns = (t - tLast) * 1000000000.0;
+    HistogramRecord(&interval_frames, ns);
+    if (run_start >= 0.0) {
+      HistogramRecord(&run_frames, ns);
+      run_frame_count++;
+      run_end = t;
+    }
+  }
+  if (run_start < 0.0 && t >= warmup_end) {
+    run_start = run_end = t;
+    PhaseTimerStartRun();
+    PresentStartRun();
+    TelemetryStartRun();
+  }
+  tLast = t;
+  PhaseEnd(PHASE_DRAW);
+  MetricsAdd(METRIC_FRAMES, 1);
+
+  if (readback) {
+    bool finished;
+
+    PhaseBegin(PHASE_READBACK);
+    PollReadback(false);
+    if (checkpoint_due) {
+      CheckFrame(next_checkpoint++);
+      checkpoint_due = false;
+    }
+    if (capture && frame % capture_every == 0)
+      CaptureFrame(frame);
+    PhaseEnd(PHASE_READBACK);
+    readback_time += current_time() - t;
+    pthread_mutex_lock(&checker.lock);
+    finished = checker.finished;
+    pthread_mutex_unlock(&checker.lock);
+    if (finished) {
+      printf("%s\n", checker.message);
+      exit(checker.exit_code);
+    }
   }
-  eglSwapBuffers(glwindow->display->egl.dpy, glwindow->egl_surface);
+  PresentFrame(glwindow->surface);
+  PhaseBegin(PHASE_SWAP);
+  swap_buffers(glwindow);
+  PhaseEnd(PHASE_SWAP);
+  StartupEnd("first frame");
+  StartupReport(stats_json);
+  PhaseTimerEndFrame();
+  TraceSpan("frame", "frame", frame_trace_start);
+  // Presentation feedback is delivered on the default queue
+  if (glwindow->display->display)
+    wl_display_dispatch_pending(glwindow->display->display);
   frame++;
+  animation_time += animation_step;
 
   if (tRate0 < 0.0) {
     tRate0 = t;
     frame0 = frame;
   }
-  if (t - tRate0 >= 5.0) {
+  if (t - tRate0 >= REPORT_INTERVAL) {
     GLfloat seconds = t - tRate0;
     GLfloat fps = (frame - frame0) / seconds;
-    printf("%d frames in %3.1f seconds = %6.3f FPS\n",
+    int i;
+    printf("%d frames in %3.1f seconds = %6.3f FPS",
            (frame - frame0), seconds, fps);
+    if (readback)
+      printf(" (readback %.3f ms/frame)",
+             (readback_time - readback0) * 1000.0 / (frame - frame0));
+    if (capture)
+      printf(" (captured %d, dropped %d)", captured_frames, dropped_frames);
+    printf("\n");
+    if (num_contexts > 1) {
+      double total = fps;
+      printf("  context fps: %.1f", fps);
+      for (i = 1; i < num_contexts; i++) {
+        struct window *w = &contexts[i];
+        unsigned done = atomic_load_explicit(&w->frames_done,
+                                             memory_order_relaxed);
+        printf(" %.1f", (done - w->interval_frames0) / seconds);
+        total += (done - w->interval_frames0) / seconds;
+        w->interval_frames0 = done;
+      }
+      printf(", aggregate %.1f FPS\n", total);
+    }
+    ReportFrameTimes("interval", &interval_frames, seconds, stats_json);
+    HistogramReset(&interval_frames);
+    PhaseTimerReport("interval", false, stats_json);
+    PresentReport("interval", false, stats_json);
+    TelemetryReport("interval", stats_json);
     fflush(stdout);
     tRate0 = t;
     frame0 = frame;
+    readback0 = readback_time;
+  }
+
+  switch (SoakPoll()) {
+  case -1:
+    printf("FAIL : memory grew more than %.0f MB during soak\n",
+           soak_max_growth);
+    exit(1);
+  case 1:
+    soak_recycle = true;
+    break;
   }
 
+  // Test and golden runs are only complete with all of their checkpoints
+  if (run_start >= 0.0 && !test && !generate_ref_images &&
+      ((bench_frames && run_frame_count >= bench_frames) ||
+       (bench_duration > 0.0 && t - run_start >= bench_duration)))
+    return 0;
+  return running;
 }
 
 static const char *vert_shader_text =
@@ -214,65 +1289,195 @@ static const char *frag_shader_text =
     "  gl_FragColor = v_color;\n"
     "}\n";
 
-static int running = 1;
+static bool has_extension(const char *extensions, const char *name)
+{
+  size_t len = strlen(name);
+  const char *p = extensions;
 
-static void
-    init_egl(struct display *display, struct window *window)
+  while (p && (p = strstr(p, name))) {
+    if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || !p[len]))
+      return true;
+    p += len;
+  }
+  return false;
+}
+
+/* EGL display of a headless backend, exits if the platform is missing */
+static EGLDisplay
+    get_headless_display(struct display *display)
+{
+  const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+      eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+  if (!get_platform_display ||
+      !has_extension(extensions, "EGL_EXT_platform_base"))
+    get_platform_display = NULL;
+
+  if (display->backend == BACKEND_GBM) {
+#ifdef HAVE_GBM
+    display->render_fd = open(display->render_node, O_RDWR | O_CLOEXEC);
+    if (display->render_fd < 0) {
+      fprintf(stderr, "could not open %s\n", display->render_node);
+      exit(EXIT_FAILURE);
+    }
+    display->gbm = gbm_create_device(display->render_fd);
+    if (!display->gbm || !get_platform_display ||
+        !has_extension(extensions, "EGL_MESA_platform_gbm")) {
+      fprintf(stderr, "no EGL GBM platform for %s\n", display->render_node);
+      exit(EXIT_FAILURE);
+    }
+    return get_platform_display(EGL_PLATFORM_GBM_MESA, display->gbm, NULL);
+#else
+    fprintf(stderr, "gbm backend not built in, rebuild with make GBM=1\n");
+    exit(EXIT_FAILURE);
+#endif
+  }
+
+  // pbuffers work on any display, surfaceless only needs no window system
+  if (get_platform_display &&
+      has_extension(extensions, "EGL_MESA_platform_surfaceless"))
+    return get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                EGL_DEFAULT_DISPLAY, NULL);
+  if (display->backend == BACKEND_PBUFFER)
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  fprintf(stderr, "EGL_MESA_platform_surfaceless is not supported\n");
+  exit(EXIT_FAILURE);
+}
+
+/* GLES1 has no FBOs, headless GLES1 always renders into a pbuffer */
+static bool
+    headless_pbuffer(struct display *display)
+{
+  return display->backend == BACKEND_PBUFFER ||
+         (GLES == 1 && display->backend == BACKEND_SURFACELESS);
+}
+
+static EGLContext
+    create_context(struct display *display)
 {
   static const EGLint context_attribs[] = {
     EGL_CONTEXT_CLIENT_VERSION, GLES,
     EGL_NONE
   };
-  const char *extensions;
+  EGLContext ctx;
+
+#if GLES==2
+  // Prefer a GLES3 context so golden readback can use PBOs
+  static const EGLint gles3_context_attribs[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 3,
+    EGL_NONE
+  };
+  ctx = eglCreateContext(display->egl.dpy, display->egl.conf,
+                         EGL_NO_CONTEXT, gles3_context_attribs);
+  if (ctx != EGL_NO_CONTEXT)
+    return ctx;
+#endif
+  ctx = eglCreateContext(display->egl.dpy, display->egl.conf,
+                         EGL_NO_CONTEXT, context_attribs);
+  assert(ctx);
+  return ctx;
+}
 
+/*
+ * Pick the first config with the window's depth buffer and exactly
+ * buffer_size color bits. Only a 32 bpp window that isn't opaque asks for
+ * alpha.
+ */
+static bool
+    choose_config(struct display *display, struct window *window)
+{
   EGLint config_attribs[] = {
     EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
     EGL_RED_SIZE, 8,
     EGL_GREEN_SIZE, 8,
     EGL_BLUE_SIZE, 8,
+    EGL_ALPHA_SIZE, 0,
     EGL_DEPTH_SIZE, 16,
     EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
     EGL_NONE
   };
-
-  EGLint major, minor, n, count, i, size;
+  EGLint n, count, i, size;
   EGLConfig *configs;
+
+  if (window->buffer_size == 16) {
+    config_attribs[3] = 5;
+    config_attribs[5] = 6;
+    config_attribs[7] = 5;
+  } else if (window->buffer_size == 32 && !window->opaque) {
+    config_attribs[9] = 1;
+  }
+  config_attribs[11] = window->depth_size;
+  // Any config will do for rendering into an FBO
+  if (display->backend != BACKEND_WAYLAND)
+    config_attribs[1] = headless_pbuffer(display) ? EGL_PBUFFER_BIT : 0;
+
+  if (!eglGetConfigs(display->egl.dpy, NULL, 0, &count) || count < 1)
+    return false;
+  configs = calloc(count, sizeof *configs);
+  assert(configs);
+
+  display->egl.conf = NULL;
+  if (eglChooseConfig(display->egl.dpy, config_attribs, configs, count, &n)) {
+    for (i = 0; i < n; i++) {
+      eglGetConfigAttrib(display->egl.dpy, configs[i], EGL_BUFFER_SIZE,
+                         &size);
+      if (size == window->buffer_size) {
+        display->egl.conf = configs[i];
+        break;
+      }
+    }
+  }
+  free(configs);
+  return display->egl.conf != NULL;
+}
+
+static void
+    init_egl(struct display *display, struct window *window)
+{
+  const char *extensions;
+  EGLint major, minor;
   EGLBoolean ret;
 
-  if (window->opaque || window->buffer_size == 16)
-    config_attribs[9] = 0;
+#if GLES==1
+  if (display->backend == BACKEND_GBM) {
+    fprintf(stderr, "gbm backend needs FBOs, use es2gears\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
 
-  display->egl.dpy = eglGetDisplay(display->display);
+  StartupBegin("eglInitialize");
+  if (display->backend == BACKEND_WAYLAND)
+    display->egl.dpy = eglGetDisplay(display->display);
+  else
+    display->egl.dpy = get_headless_display(display);
 
   ret = eglInitialize(display->egl.dpy, &major, &minor);
   assert(ret == EGL_TRUE);
+  StartupEnd("eglInitialize");
   ret = eglBindAPI(EGL_OPENGL_ES_API);
   assert(ret == EGL_TRUE);
 
-  if (!eglGetConfigs(display->egl.dpy, NULL, 0, &count) || count < 1)
-    assert(0);
-
-  configs = calloc(count, sizeof *configs);
-  assert(configs);
-
-  ret = eglChooseConfig(display->egl.dpy, config_attribs,
-                        configs, 1, &n);
-  assert(ret && n >= 1);
-
-  display->egl.conf = configs[0];
-
-  free(configs);
-  if (display->egl.conf == NULL) {
-    fprintf(stderr, "did not find config with buffer size %d\n",
-            window->buffer_size);
+  StartupBegin("eglChooseConfig");
+  if (!choose_config(display, window)) {
+    fprintf(stderr, "did not find config with buffer size %d and depth "
+            "size %d\n", window->buffer_size, window->depth_size);
     exit(EXIT_FAILURE);
   }
+  StartupEnd("eglChooseConfig");
 
-  display->egl.ctx = eglCreateContext(display->egl.dpy,
-                                      display->egl.conf,
-                                      EGL_NO_CONTEXT, context_attribs);
-  assert(display->egl.ctx);
+  StartupBegin("eglCreateContext");
+  display->egl.ctx = window->ctx = create_context(display);
+  StartupEnd("eglCreateContext");
 
+  extensions = eglQueryString(display->egl.dpy, EGL_EXTENSIONS);
+  if (display->backend != BACKEND_WAYLAND && !headless_pbuffer(display) &&
+      !has_extension(extensions, "EGL_KHR_surfaceless_context")) {
+    fprintf(stderr, "%s backend needs EGL_KHR_surfaceless_context\n",
+            backend_names[display->backend]);
+    exit(EXIT_FAILURE);
+  }
 }
 
 static void
@@ -280,6 +1485,116 @@ static void
 {
   eglTerminate(display->egl.dpy);
   eglReleaseThread();
+#ifdef HAVE_GBM
+  if (display->gbm)
+    gbm_device_destroy(display->gbm);
+#endif
+  if (display->render_fd > 0)
+    close(display->render_fd);
+}
+
+#if GLES==2
+/* True if the current context can throttle on fences */
+static bool
+    has_fences(void)
+{
+  const char *version = (const char *) glGetString(GL_VERSION);
+  return version && strncmp(version, "OpenGL ES 3", 11) == 0;
+}
+#endif
+
+static void
+    create_headless_surface(struct window *window)
+{
+  struct display *display = window->display;
+  EGLBoolean ret;
+
+  if (headless_pbuffer(display)) {
+    EGLint attribs[] = {
+      EGL_WIDTH, window->geometry.width,
+      EGL_HEIGHT, window->geometry.height,
+      EGL_NONE
+    };
+    window->egl_surface = eglCreatePbufferSurface(display->egl.dpy,
+                                                  display->egl.conf, attribs);
+    assert(window->egl_surface != EGL_NO_SURFACE);
+    ret = eglMakeCurrent(display->egl.dpy, window->egl_surface,
+                         window->egl_surface, window->ctx);
+    assert(ret == EGL_TRUE);
+#if GLES==2
+    window->use_fences = has_fences();
+#endif
+    return;
+  }
+
+  window->egl_surface = EGL_NO_SURFACE;
+  ret = eglMakeCurrent(display->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                       window->ctx);
+  assert(ret == EGL_TRUE);
+
+#if GLES==2
+  // Same channels as the chosen config, so golden images match the other
+  // backends including alpha
+  EGLint red_size = 8, alpha_size = 0, depth_size = 16;
+  eglGetConfigAttrib(display->egl.dpy, display->egl.conf, EGL_RED_SIZE,
+                     &red_size);
+  eglGetConfigAttrib(display->egl.dpy, display->egl.conf, EGL_ALPHA_SIZE,
+                     &alpha_size);
+  eglGetConfigAttrib(display->egl.dpy, display->egl.conf, EGL_DEPTH_SIZE,
+                     &depth_size);
+  glGenRenderbuffers(1, &window->color_rb);
+  glBindRenderbuffer(GL_RENDERBUFFER, window->color_rb);
+  glRenderbufferStorage(GL_RENDERBUFFER,
+                        red_size < 8 ? GL_RGB565 :
+                        alpha_size ? GL_RGBA8 : GL_RGB8,
+                        window->geometry.width, window->geometry.height);
+  if (depth_size) {
+    glGenRenderbuffers(1, &window->depth_rb);
+    glBindRenderbuffer(GL_RENDERBUFFER, window->depth_rb);
+    glRenderbufferStorage(GL_RENDERBUFFER, depth_size > 16 ?
+                          GL_DEPTH_COMPONENT24 : GL_DEPTH_COMPONENT16,
+                          window->geometry.width, window->geometry.height);
+  }
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGenFramebuffers(1, &window->fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, window->fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, window->color_rb);
+  if (depth_size)
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, window->depth_rb);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "could not create a %dx%d framebuffer\n",
+            window->geometry.width, window->geometry.height);
+    exit(EXIT_FAILURE);
+  }
+
+  window->use_fences = has_fences();
+#endif
+}
+
+static void
+    destroy_headless_surface(struct window *window)
+{
+#if GLES==2
+  int i;
+
+  for (i = 0; i < HEADLESS_FRAMES; i++)
+    if (window->fences[i])
+      glDeleteSync(window->fences[i]);
+  if (window->fbo) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &window->fbo);
+    glDeleteRenderbuffers(1, &window->color_rb);
+    if (window->depth_rb)
+      glDeleteRenderbuffers(1, &window->depth_rb);
+  }
+#endif
+  eglMakeCurrent(window->display->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 EGL_NO_CONTEXT);
+  if (window->egl_surface != EGL_NO_SURFACE)
+    eglDestroySurface(window->display->egl.dpy, window->egl_surface);
 }
 
 static void
@@ -290,6 +1605,12 @@ static void
 
   EGLBoolean ret;
 
+  StartupBegin("surface");
+  if (display->backend != BACKEND_WAYLAND) {
+    create_headless_surface(window);
+    StartupEnd("surface");
+    return;
+  }
   window->surface = wl_compositor_create_surface(display->compositor);
 
   shell_surface = wl_shell_get_shell_surface(display->shell,
@@ -303,21 +1624,35 @@ static void
   window->egl_surface = eglCreateWindowSurface(display->egl.dpy,
                                                display->egl.conf,
                                                window->native, NULL);
+  // Lets the compositor skip blending the window
+  if (window->opaque || window->buffer_size == 16) {
+    struct wl_region *region;
+
+    region = wl_compositor_create_region(display->compositor);
+    wl_region_add(region, 0, 0, window->geometry.width,
+                  window->geometry.height);
+    wl_surface_set_opaque_region(window->surface, region);
+    wl_region_destroy(region);
+  }
   window->wait_for_configure = true;
   wl_surface_commit(window->surface);
 
   ret = eglMakeCurrent(window->display->egl.dpy, window->egl_surface,
-                       window->egl_surface, window->display->egl.ctx);
+                       window->egl_surface, window->ctx);
   assert(ret == EGL_TRUE);
 
-  if (!window->frame_sync)
-    eglSwapInterval(display->egl.dpy, 0);
-
+  if (window->frame_sync != 1)
+    eglSwapInterval(display->egl.dpy, window->frame_sync);
+  StartupEnd("surface");
 }
 
 static void
     destroy_surface(struct window *window)
 {
+  if (window->display->backend != BACKEND_WAYLAND) {
+    destroy_headless_surface(window);
+    return;
+  }
   /* Required, otherwise segfault in egl_dri2.c: dri2_make_current()
    * on eglReleaseThread(). */
   eglMakeCurrent(window->display->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
@@ -330,6 +1665,156 @@ static void
 
 }
 
+/* Render thread of an extra context, see StartContexts() */
+static void *
+    context_thread(void *data)
+{
+  struct window *window = data;
+
+  snprintf(window->name, sizeof(window->name), "context %d", window->index);
+  TraceThreadName(window->name);
+  glwindow = window;
+  window->ctx = create_context(window->display);
+  create_surface(window);
+  RunGears(window);
+  destroy_surface(window);
+  eglDestroyContext(window->display->egl.dpy, window->ctx);
+  eglReleaseThread();
+  return NULL;
+}
+
+/* Start the render threads of the windows beyond the main one */
+static void
+    StartContexts(struct window *main_window)
+{
+  int i;
+
+  contexts = calloc(num_contexts, sizeof(*contexts));
+  context_threads = calloc(num_contexts, sizeof(*context_threads));
+  assert(contexts && context_threads);
+  for (i = 1; i < num_contexts; i++) {
+    struct window *w = &contexts[i];
+
+    w->display = main_window->display;
+    w->index = i;
+    w->geometry = w->window_size = main_window->geometry;
+    w->buffer_size = main_window->buffer_size;
+    w->opaque = main_window->opaque;
+    w->frame_sync = main_window->frame_sync;
+    w->depth_size = main_window->depth_size;
+    w->delay = main_window->delay;
+    w->warmup_end = w->run_start = -1.0;
+    if (pthread_create(&context_threads[i], NULL, context_thread, w) != 0) {
+      fprintf(stderr, "could not start render thread %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  contexts_running = true;
+}
+
+/*
+ * -sweep runs the gears in every combination of color depth, opacity and
+ * swap interval, one after the other with a new config, context and
+ * surface each, then tabulates them.
+ */
+static const int sweep_buffer_sizes[] = { 16, 32 };
+/* Buffer sizes x opaque or not x swap interval 0 or 1 */
+#define SWEEP_CONFIGS 8
+
+struct sweep_result {
+  int buffer_size, opaque, swap_interval;
+  /* Why the combination wasn't run, NULL if it was */
+  const char *skipped;
+  double seconds;
+  struct histogram_stats st;
+};
+
+static void
+    RunSweep(struct window *window)
+{
+  struct display *display = window->display;
+  struct sweep_result results[SWEEP_CONFIGS], *best = NULL, *r;
+  FILE *json = stats_json ? stats_json : stdout;
+  int i, count = 0;
+
+  if (!bench_frames && bench_duration <= 0.0)
+    bench_duration = SWEEP_DURATION;
+  eglMakeCurrent(display->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 EGL_NO_CONTEXT);
+  eglDestroyContext(display->egl.dpy, display->egl.ctx);
+
+  for (i = 0; i < SWEEP_CONFIGS && running; i++) {
+    r = &results[count++];
+    memset(r, 0, sizeof(*r));
+    r->buffer_size = window->buffer_size = sweep_buffer_sizes[i / 4];
+    r->opaque = window->opaque = i / 2 % 2 == 0;
+    r->swap_interval = window->frame_sync = i % 2;
+    printf("sweep: %d bpp, %s, swap interval %d\n", r->buffer_size,
+           r->opaque ? "opaque" : "alpha", r->swap_interval);
+    // 16 bpp configs are RGB565 and always opaque, and only window
+    // surfaces have a swap interval, so these would repeat another run
+    if (r->buffer_size == 16 && !r->opaque)
+      r->skipped = "no alpha at 16 bpp";
+    else if (display->backend != BACKEND_WAYLAND && r->swap_interval)
+      r->skipped = "no swap interval headless";
+    else if (!choose_config(display, window))
+      r->skipped = "no config";
+    if (r->skipped) {
+      printf("sweep: %s, skipped\n", r->skipped);
+      continue;
+    }
+    display->egl.ctx = window->ctx = create_context(display);
+    create_surface(window);
+    ResetRun();
+    RunGears(window);
+    r->seconds = run_end - run_start;
+    HistogramStats(&run_frames, &r->st);
+    destroy_surface(window);
+    eglDestroyContext(display->egl.dpy, window->ctx);
+    display->egl.ctx = window->ctx = EGL_NO_CONTEXT;
+  }
+
+  printf("sweep results, %s:\n"
+         "  bpp  alpha  interval      fps   p50 ms   p90 ms   p99 ms   "
+         "max ms\n", backend_names[display->backend]);
+  for (i = 0; i < count; i++) {
+    r = &results[i];
+    if (r->skipped || r->seconds <= 0.0) {
+      printf("  %3d  %5s  %8d  (%s)\n", r->buffer_size,
+             r->opaque ? "no" : "yes", r->swap_interval,
+             r->skipped ? r->skipped : "no frames");
+      continue;
+    }
+    printf("  %3d  %5s  %8d  %7.1f  %7.2f  %7.2f  %7.2f  %7.2f\n",
+           r->buffer_size, r->opaque ? "no" : "yes", r->swap_interval,
+           r->st.count / r->seconds, r->st.p50 / 1e6, r->st.p90 / 1e6,
+           r->st.p99 / 1e6, r->st.max / 1e6);
+    if (!best || r->st.count / r->seconds > best->st.count / best->seconds)
+      best = r;
+  }
+  if (best)
+    printf("fastest: %d bpp, %s, swap interval %d at %.1f FPS\n",
+           best->buffer_size, best->opaque ? "opaque" : "alpha",
+           best->swap_interval, best->st.count / best->seconds);
+  fflush(stdout);
+
+  for (i = 0; i < count; i++) {
+    r = &results[i];
+    if (r->skipped || r->seconds <= 0.0)
+      continue;
+    fprintf(json, "{\"report\":\"sweep\",\"backend\":\"%s\",\"bpp\":%d,"
+            "\"opaque\":%s,\"swap_interval\":%d,\"frames\":%llu,"
+            "\"fps\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,"
+            "\"max_ms\":%.3f,\"jitter_ms\":%.3f}\n",
+            backend_names[display->backend], r->buffer_size,
+            r->opaque ? "true" : "false", r->swap_interval,
+            (unsigned long long) r->st.count, r->st.count / r->seconds,
+            r->st.p50 / 1e6, r->st.p90 / 1e6, r->st.p99 / 1e6,
+            r->st.max / 1e6, r->st.stddev / 1e6);
+  }
+  fflush(json);
+}
+
 static void
     registry_handle_global(void *data, struct wl_registry *registry,
                            uint32_t name, const char *interface, uint32_t version)
@@ -344,6 +1829,8 @@ static void
   } else if (strcmp(interface, "wl_shell") == 0) {
     d->shell = wl_registry_bind(registry, name,
                                 &wl_shell_interface, 1);
+  } else if (strcmp(interface, "wp_presentation") == 0) {
+    PresentBind(registry, name, version);
   }
 }
 
@@ -358,6 +1845,20 @@ static const struct wl_registry_listener registry_listener = {
   registry_handle_global_remove
 };
 
+static void
+    disconnect_display(struct display *display)
+{
+  if (display->backend != BACKEND_WAYLAND)
+    return;
+
+  if (display->compositor)
+    wl_compositor_destroy(display->compositor);
+
+  wl_registry_destroy(display->registry);
+  wl_display_flush(display->display);
+  wl_display_disconnect(display->display);
+}
+
 static void
     signal_int(int signum)
 {
@@ -365,7 +1866,74 @@ static void
 }
 
 static void usage(char *appname) {
-  printf("Usage: %s [-golden | -test | -h]\n", appname);
+  printf("Usage: %s [-golden | -test] [-sync-readback] [-tolerance N|R,G,B,A]\n"
+         "       [-max-bad-pixels N] [-size WxH] [-checkpoints T0,T1,...]\n"
+         "       [-checkpoint-interval S] [-anim-step S]\n"
+         "       [-cl-compare gpu|cpu|any] [-gpu-compare]\n"
+         "       [-capture FILE.y4m] [-frame-budget MS] [-stats-json FILE]\n"
+         "       [-capture-every N] [-frames N] [-duration S] [-warmup S]\n"
+         "       [-perf] [-telemetry MS] [-trace FILE.json]\n"
+         "       [-soak S] [-soak-max-growth MB] [-metrics NAME]\n"
+         "       [-backend wayland|surfaceless|pbuffer|gbm]\n"
+         "       [-render-node PATH] [-contexts N]\n"
+         "       [-bpp 16|24|32] [-opaque] [-depth N] [-swap-interval N]\n"
+         "       [-delay US] [-sweep] [-program-cache DIR] [-h]\n",
+         appname);
+}
+
+static bool parse_backend(const char *arg, enum backend *backend)
+{
+  int i;
+
+  for (i = 0; i < (int) (sizeof(backend_names) / sizeof(backend_names[0])); i++) {
+    if (strcmp(arg, backend_names[i]) == 0) {
+      *backend = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Parse a comma separated list of increasing checkpoint times */
+static bool parse_checkpoints(const char *arg)
+{
+  const char *p = arg;
+  char *end;
+
+  free(checkpoint_times);
+  checkpoint_times = NULL;
+  num_checkpoints = 0;
+  while (*p) {
+    double t = strtod(p, &end);
+    if (end == p || t < 0.0 ||
+        (num_checkpoints && t <= checkpoint_times[num_checkpoints - 1]))
+      return false;
+    checkpoint_times = realloc(checkpoint_times,
+                               (num_checkpoints + 1) * sizeof(double));
+    checkpoint_times[num_checkpoints++] = t;
+    p = *end == ',' ? end + 1 : end;
+    if (*end && *end != ',')
+      return false;
+  }
+  return num_checkpoints > 0;
+}
+
+/* Parse "N" or "R,G,B,A" into per-channel tolerances */
+static bool parse_tolerance(const char *arg, uint8_t tol[4])
+{
+  unsigned v[4];
+  int n = sscanf(arg, "%u,%u,%u,%u", &v[0], &v[1], &v[2], &v[3]);
+
+  if (n == 1)
+    v[1] = v[2] = v[3] = v[0];
+  else if (n != 4)
+    return false;
+  for (n = 0; n < 4; n++) {
+    if (v[n] > 255)
+      return false;
+    tol[n] = v[n];
+  }
+  return true;
 }
 
 int
@@ -374,7 +1942,12 @@ int
   struct sigaction sigint;
   struct display display = { 0 };
   struct window	 window	 = { 0 };
-  int i, ret = 0;
+  char golden_path[256];
+  double checkpoint_interval = CHECKPOINT_INTERVAL;
+  bool sweep = false, swap_interval_set = false, checks_ok;
+  const char *program_cache_dir = NULL;
+  size_t frame_bytes, writer_bytes, arena_size;
+  int i;
 
   window.display = &display;
   glwindow = display.window = &window;
@@ -382,25 +1955,130 @@ int
   window.geometry.height = WINDOW_HEIGHT;
   window.window_size = window.geometry;
   window.buffer_size = 32;
+  window.depth_size = 16;
   window.frame_sync = 1;
   window.delay = 0;
+  display.render_node = DEFAULT_RENDER_NODE;
+  display.render_fd = -1;
 
   AppName = basename(argv[0]);
-  if (argc > 2) {
-    usage(AppName);
-    exit(1);
-  }
-
-  if (argc == 2) {
-    if (strcmp("-golden", argv[1]) == 0) {
+  for (i = 1; i < argc; i++) {
+    if (strcmp("-golden", argv[i]) == 0 && !test) {
       struct stat st = {0};
       if (stat(GOLDEN_IMG_DIR, &st) == -1) {
         mkdir(GOLDEN_IMG_DIR, 0700);
       }
       generate_ref_images = true;
-    } else if (strcmp("-test", argv[1]) == 0) {
+    } else if (strcmp("-test", argv[i]) == 0 && !generate_ref_images) {
       test = true;
-    } else if (strcmp("-h", argv[1]) == 0) {
+    } else if (strcmp("-sync-readback", argv[i]) == 0) {
+      sync_readback = true;
+    } else if (strcmp("-tolerance", argv[i]) == 0 && i + 1 < argc &&
+               parse_tolerance(argv[i + 1], tolerance)) {
+      i++;
+    } else if (strcmp("-max-bad-pixels", argv[i]) == 0 && i + 1 < argc) {
+      max_bad_pixels = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp("-size", argv[i]) == 0 && i + 1 < argc &&
+               sscanf(argv[i + 1], "%dx%d", &window.geometry.width,
+                      &window.geometry.height) == 2 &&
+               window.geometry.width > 0 && window.geometry.height > 0) {
+      window.window_size = window.geometry;
+      i++;
+    } else if (strcmp("-checkpoints", argv[i]) == 0 && i + 1 < argc &&
+               parse_checkpoints(argv[i + 1])) {
+      i++;
+    } else if (strcmp("-checkpoint-interval", argv[i]) == 0 && i + 1 < argc &&
+               (checkpoint_interval = atof(argv[i + 1])) > 0.0) {
+      i++;
+    } else if (strcmp("-cl-compare", argv[i]) == 0 && i + 1 < argc) {
+      use_cl_compare = true;
+      if (strcmp(argv[++i], "gpu") == 0) {
+        cl_compare_device = CL_COMPARE_GPU;
+      } else if (strcmp(argv[i], "cpu") == 0) {
+        cl_compare_device = CL_COMPARE_CPU;
+      } else if (strcmp(argv[i], "any") == 0) {
+        cl_compare_device = CL_COMPARE_ANY;
+      } else {
+        usage(AppName);
+        exit(1);
+      }
+    } else if (strcmp("-anim-step", argv[i]) == 0 && i + 1 < argc &&
+               (animation_step = atof(argv[i + 1])) > 0.0) {
+      i++;
+    } else if (strcmp("-gpu-compare", argv[i]) == 0) {
+      use_gpu_compare = true;
+    } else if (strcmp("-capture", argv[i]) == 0 && i + 1 < argc) {
+      capture_path = argv[++i];
+    } else if (strcmp("-capture-every", argv[i]) == 0 && i + 1 < argc &&
+               (capture_every = atoi(argv[i + 1])) > 0) {
+      i++;
+    } else if (strcmp("-frame-budget", argv[i]) == 0 && i + 1 < argc &&
+               (frame_budget = atof(argv[i + 1])) > 0.0) {
+      i++;
+    } else if (strcmp("-stats-json", argv[i]) == 0 && i + 1 < argc) {
+      stats_json = strcmp(argv[++i], "-") == 0 ? stdout
+                                                : fopen(argv[i], "w");
+      if (!stats_json) {
+        fprintf(stderr, "could not open %s\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp("-frames", argv[i]) == 0 && i + 1 < argc &&
+               (bench_frames = atoi(argv[i + 1])) > 0) {
+      i++;
+    } else if (strcmp("-duration", argv[i]) == 0 && i + 1 < argc &&
+               (bench_duration = atof(argv[i + 1])) > 0.0) {
+      i++;
+    } else if (strcmp("-warmup", argv[i]) == 0 && i + 1 < argc &&
+               (warmup = atof(argv[i + 1])) >= 0.0) {
+      i++;
+    } else if (strcmp("-perf", argv[i]) == 0) {
+      PerfInit();
+    } else if (strcmp("-soak", argv[i]) == 0 && i + 1 < argc &&
+               (soak_period = atof(argv[i + 1])) > 0.0) {
+      i++;
+    } else if (strcmp("-soak-max-growth", argv[i]) == 0 && i + 1 < argc &&
+               (soak_max_growth = atof(argv[i + 1])) > 0.0) {
+      i++;
+    } else if (strcmp("-telemetry", argv[i]) == 0 && i + 1 < argc &&
+               (telemetry_period = atof(argv[i + 1]) / 1000.0) > 0.0) {
+      i++;
+    } else if (strcmp("-trace", argv[i]) == 0 && i + 1 < argc) {
+      if (!TraceOpen(argv[++i]))
+        exit(1);
+      TraceThreadName("render");
+      atexit(TraceClose);
+    } else if (strcmp("-metrics", argv[i]) == 0 && i + 1 < argc) {
+      if (!MetricsOpen(argv[++i], AppName))
+        exit(1);
+      atexit(MetricsClose);
+    } else if (strcmp("-backend", argv[i]) == 0 && i + 1 < argc &&
+               parse_backend(argv[i + 1], &display.backend)) {
+      i++;
+    } else if (strcmp("-render-node", argv[i]) == 0 && i + 1 < argc) {
+      display.render_node = argv[++i];
+    } else if (strcmp("-contexts", argv[i]) == 0 && i + 1 < argc &&
+               (num_contexts = atoi(argv[i + 1])) > 0) {
+      i++;
+    } else if (strcmp("-bpp", argv[i]) == 0 && i + 1 < argc &&
+               (window.buffer_size = atoi(argv[i + 1])) > 0) {
+      i++;
+    } else if (strcmp("-opaque", argv[i]) == 0) {
+      window.opaque = 1;
+    } else if (strcmp("-depth", argv[i]) == 0 && i + 1 < argc &&
+               (window.depth_size = atoi(argv[i + 1])) >= 0) {
+      i++;
+    } else if (strcmp("-swap-interval", argv[i]) == 0 && i + 1 < argc &&
+               (window.frame_sync = atoi(argv[i + 1])) >= 0) {
+      swap_interval_set = true;
+      i++;
+    } else if (strcmp("-delay", argv[i]) == 0 && i + 1 < argc &&
+               (window.delay = atoi(argv[i + 1])) >= 0) {
+      i++;
+    } else if (strcmp("-sweep", argv[i]) == 0) {
+      sweep = true;
+    } else if (strcmp("-program-cache", argv[i]) == 0 && i + 1 < argc) {
+      program_cache_dir = argv[++i];
+    } else if (strcmp("-h", argv[i]) == 0) {
       usage(AppName);
       exit(0);
     } else {
@@ -409,42 +2087,159 @@ int
     }
   }
 
-  display.display = wl_display_connect(NULL);
-  assert(display.display);
+  if (display.backend == BACKEND_WAYLAND) {
+    StartupBegin("wl_display_connect");
+    display.display = wl_display_connect(NULL);
+    assert(display.display);
+    StartupEnd("wl_display_connect");
 
-  display.registry = wl_display_get_registry(display.display);
-  wl_registry_add_listener(display.registry,
-                           &registry_listener, &display);
+    StartupBegin("registry roundtrip");
+    display.registry = wl_display_get_registry(display.display);
+    wl_registry_add_listener(display.registry,
+                             &registry_listener, &display);
 
-  ret = wl_display_dispatch(display.display);
-  wl_display_roundtrip(display.display);
+    wl_display_dispatch(display.display);
+    wl_display_roundtrip(display.display);
+    StartupEnd("registry roundtrip");
+  }
 
-  init_egl(&display, &window);
-  create_surface(&window);
+  if (sweep && (test || generate_ref_images || capture_path ||
+                num_contexts > 1)) {
+    fprintf(stderr, "-sweep can't be combined with -golden, -test, "
+            "-capture or -contexts\n");
+    exit(1);
+  }
+
+  // Program binaries only persist across runs with -program-cache
+#if GLES==2
+  if (program_cache_dir)
+    ProgramCacheOpen(program_cache_dir, AppName);
+#else
+  (void) program_cache_dir;
+#endif
+
+  // Checkpoints don't depend on frame pacing, validate as fast as possible
+  // unless -swap-interval asks for a specific one
+  if ((test || generate_ref_images) && !swap_interval_set)
+    window.frame_sync = 0;
 
   sigint.sa_handler = signal_int;
   sigemptyset(&sigint.sa_mask);
   sigint.sa_flags = SA_RESETHAND;
   sigaction(SIGINT, &sigint, NULL);
 
+  init_egl(&display, &window);
+  if (sweep) {
+    RunSweep(&window);
+    PresentRelease();
+    PerfRelease();
+    fini_egl(&display);
+    disconnect_display(&display);
+    return 0;
+  }
+  create_surface(&window);
+  PhaseTimerInit(display.egl.dpy);
+
+  frame_bytes = (size_t) window.geometry.width * window.geometry.height * 4;
+  writer_bytes = GoldenWriterBufferSize(window.geometry.width,
+                                        window.geometry.height);
+  readback = test || generate_ref_images || capture_path;
+  arena_size = readback ? ReadbackArenaSize() : 0;
+  if (test)
+    arena_size += frame_bytes + ARENA_ALIGN;
+  else if (generate_ref_images)
+    arena_size += writer_bytes + ARENA_ALIGN;
+  if (arena_size)
+    InitArena(arena_size);
+
+  snprintf(golden_path, sizeof(golden_path), "%s/%s_%dx%d.golden",
+           GOLDEN_IMG_DIR, AppName, window.geometry.width,
+           window.geometry.height);
+  if (test) {
+    int width, height;
+    golden_archive = GoldenArchiveOpen(golden_path);
+    if (!golden_archive) {
+      printf("FAIL : No golden images to compare with\n");
+      exit(1);
+    }
+    GoldenArchiveSize(golden_archive, &width, &height);
+    if (width != window.geometry.width || height != window.geometry.height) {
+      printf("FAIL : golden image has wrong size\n");
+      exit(1);
+    }
+    if (GoldenArchiveTileSize(golden_archive) != GOLDEN_TILE_SIZE) {
+      printf("FAIL : golden image archive has unsupported tile size\n");
+      exit(1);
+    }
+    GoldenArchiveSetFrameBuffer(golden_archive, ArenaAlloc(frame_bytes));
+    // Check the same scene states the golden images were taken at
+    num_checkpoints = GoldenArchiveFrames(golden_archive);
+    checkpoint_times = realloc(checkpoint_times,
+                               num_checkpoints * sizeof(double));
+    for (i = 0; i < num_checkpoints; i++)
+      checkpoint_times[i] = GoldenArchiveTime(golden_archive, i);
+
+    if (use_cl_compare)
+      use_cl_compare = ClCompareInit(cl_compare_device, width, height,
+                                     GoldenArchiveTileSize(golden_archive));
+  } else if (generate_ref_images) {
+    if (!checkpoint_times) {
+      num_checkpoints = NUM_GOLDEN_IMAGES + 1;
+      checkpoint_times = malloc(num_checkpoints * sizeof(double));
+      for (i = 0; i < num_checkpoints; i++)
+        checkpoint_times[i] = i * checkpoint_interval;
+    }
+    golden_writer = GoldenWriterOpen(golden_path, window.geometry.width,
+                                     window.geometry.height,
+                                     ArenaAlloc(writer_bytes));
+    if (!golden_writer)
+      exit(1);
+  }
+  if (capture_path) {
+    // Timestamps follow animation time, so playback runs at scene speed
+    capture = CaptureOpen(capture_path, window.geometry.width,
+                          window.geometry.height, 1000000,
+                          (int) (animation_step * capture_every * 1000000.0 +
+                                 0.5));
+    if (!capture) {
+      fprintf(stderr, "could not open capture file %s\n", capture_path);
+      exit(1);
+    }
+  }
+  if (readback)
+    InitReadback();
+  if (capture)
+    atexit(StopCapture);
+
+  atexit(ReportRun);
+  if (telemetry_period > 0.0)
+    TelemetryStart(telemetry_period);
+  if (soak_period > 0.0)
+    SoakStart(soak_period, soak_max_growth);
+
   /* The mainloop here is a little subtle.  Redrawing will cause
    * EGL to read events so we can just call
    * wl_display_dispatch_pending() to handle any events that got
    * queued up as a side effect. */
 
+  if (num_contexts > 1)
+    StartContexts(&window);
   RunGears((void *)&window);
-
+  StopContexts();
+
+  StopCapture();
+  checks_ok = StopChecks();
+  ReportRun();
+  TelemetryStop();
+  TraceClose();
+  MetricsClose();
   fprintf(stderr, "simple-egl exiting\n");
 
+  PresentRelease();
+  PerfRelease();
   destroy_surface(&window);
   fini_egl(&display);
+  disconnect_display(&display);
 
-  if (display.compositor)
-    wl_compositor_destroy(display.compositor);
-
-  wl_registry_destroy(display.registry);
-  wl_display_flush(display.display);
-  wl_display_disconnect(display.display);
-
-  return 0;
+  return checks_ok ? 0 : 1;
 }
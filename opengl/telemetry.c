@@ -0,0 +1,363 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Every sensor file is opened once and re-read with pread() at offset 0,
+ * which sysfs answers with a fresh value, so a sample costs one syscall
+ * per sensor. Samples go into a ring that the render thread drains into
+ * the JSON report, so only one thread ever writes to that file.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "telemetry.h"
+
+#define THERMAL_DIR "/sys/class/thermal"
+#define CPU_DIR "/sys/devices/system/cpu"
+#define MAX_SENSORS 64
+/* Samples kept between two reports, older ones are dropped */
+#define SAMPLE_RING 256
+
+enum sensor_kind {
+  SENSOR_THERMAL,   /* millidegrees Celsius */
+  SENSOR_CPUFREQ,   /* kHz */
+};
+
+struct sensor {
+  enum sensor_kind kind;
+  char name[32];
+  int fd;
+  /* Whole run statistics, in the sensor's sysfs unit */
+  int64_t min, max, sum;
+  uint64_t count;
+};
+
+struct sample {
+  double time;
+  int32_t values[MAX_SENSORS];
+};
+
+static struct {
+  struct sensor sensors[MAX_SENSORS];
+  int count;
+  double period;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t stop_cond;
+  bool started, stop;
+  struct sample ring[SAMPLE_RING];
+  int head, queued;
+  uint64_t dropped;
+  struct sample latest;
+  bool have_latest;
+} telemetry = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void add_sensor(enum sensor_kind kind, const char *name,
+                       const char *path)
+{
+  struct sensor *s;
+  char buf[32];
+  int fd;
+
+  if (telemetry.count == MAX_SENSORS)
+    return;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  // Some nodes exist but fail to read, e.g. zones of powered down blocks
+  if (pread(fd, buf, sizeof(buf) - 1, 0) <= 0) {
+    close(fd);
+    return;
+  }
+  s = &telemetry.sensors[telemetry.count++];
+  s->kind = kind;
+  snprintf(s->name, sizeof(s->name), "%s", name);
+  s->fd = fd;
+}
+
+/* Name a thermal zone after its type, falling back to the zone number */
+static void thermal_name(const char *zone, char *name, size_t size)
+{
+  char path[300];
+  ssize_t len;
+  int fd;
+
+  snprintf(name, size, "%s", zone);
+  snprintf(path, sizeof(path), THERMAL_DIR "/%s/type", zone);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  len = read(fd, name, size - 1);
+  close(fd);
+  if (len <= 0) {
+    snprintf(name, size, "%s", zone);
+    return;
+  }
+  name[len] = '\0';
+  name[strcspn(name, "\n")] = '\0';
+}
+
+static int compare_names(const struct dirent **a, const struct dirent **b)
+{
+  return strverscmp((*a)->d_name, (*b)->d_name);
+}
+
+static void find_sensors(const char *dir, const char *prefix,
+                         enum sensor_kind kind)
+{
+  struct dirent **entries;
+  int i, n = scandir(dir, &entries, NULL, compare_names);
+
+  for (i = 0; i < n; i++) {
+    const char *entry = entries[i]->d_name;
+    char path[300], name[32];
+
+    if (strncmp(entry, prefix, strlen(prefix)) == 0 &&
+        entry[strlen(prefix)] >= '0' && entry[strlen(prefix)] <= '9') {
+      if (kind == SENSOR_THERMAL) {
+        snprintf(path, sizeof(path), "%s/%s/temp", dir, entry);
+        thermal_name(entry, name, sizeof(name));
+      } else {
+        snprintf(path, sizeof(path), "%s/%s/cpufreq/scaling_cur_freq", dir,
+                 entry);
+        snprintf(name, sizeof(name), "%.31s", entry);
+      }
+      add_sensor(kind, name, path);
+    }
+    free(entries[i]);
+  }
+  if (n >= 0)
+    free(entries);
+}
+
+static void take_sample(void)
+{
+  struct sample sample;
+  int i;
+
+  sample.time = now();
+  for (i = 0; i < telemetry.count; i++) {
+    char buf[32];
+    ssize_t len = pread(telemetry.sensors[i].fd, buf, sizeof(buf) - 1, 0);
+    buf[len > 0 ? len : 0] = '\0';
+    sample.values[i] = len > 0 ? atoi(buf) : 0;
+  }
+
+  pthread_mutex_lock(&telemetry.lock);
+  for (i = 0; i < telemetry.count; i++) {
+    struct sensor *s = &telemetry.sensors[i];
+    int64_t v = sample.values[i];
+    if (!s->count || v < s->min)
+      s->min = v;
+    if (!s->count || v > s->max)
+      s->max = v;
+    s->sum += v;
+    s->count++;
+  }
+  if (telemetry.queued == SAMPLE_RING) {
+    telemetry.head = (telemetry.head + 1) % SAMPLE_RING;
+    telemetry.queued--;
+    telemetry.dropped++;
+  }
+  telemetry.ring[(telemetry.head + telemetry.queued++) % SAMPLE_RING] = sample;
+  telemetry.latest = sample;
+  telemetry.have_latest = true;
+  pthread_mutex_unlock(&telemetry.lock);
+}
+
+static void *SamplerThread(void *arg)
+{
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  pthread_mutex_lock(&telemetry.lock);
+  while (!telemetry.stop) {
+    pthread_mutex_unlock(&telemetry.lock);
+    take_sample();
+    pthread_mutex_lock(&telemetry.lock);
+
+    // Absolute deadlines keep the rate steady whatever a sample costs.
+    // Whole seconds go to tv_sec, a 32-bit long only holds ~2.1 s of ns
+    next.tv_sec += (time_t) telemetry.period;
+    next.tv_nsec += (long) ((telemetry.period - (time_t) telemetry.period) *
+                            1000000000.0);
+    next.tv_sec += next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    while (!telemetry.stop &&
+           pthread_cond_timedwait(&telemetry.stop_cond, &telemetry.lock,
+                                  &next) == 0)
+      ;
+  }
+  pthread_mutex_unlock(&telemetry.lock);
+  return NULL;
+}
+
+bool TelemetryStart(double period)
+{
+  pthread_condattr_t attr;
+
+  find_sensors(THERMAL_DIR, "thermal_zone", SENSOR_THERMAL);
+  find_sensors(CPU_DIR, "cpu", SENSOR_CPUFREQ);
+  if (!telemetry.count) {
+    fprintf(stderr, "no thermal or cpufreq sensors, telemetry off\n");
+    return false;
+  }
+
+  telemetry.period = period;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&telemetry.stop_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&telemetry.thread, NULL, SamplerThread, NULL) != 0)
+    return false;
+  telemetry.started = true;
+  return true;
+}
+
+static void print_value(const struct sensor *s, double v)
+{
+  if (s->kind == SENSOR_THERMAL)
+    printf(" %s %.1fC", s->name, v / 1000.0);
+  else
+    printf(" %s %.0fMHz", s->name, v / 1000.0);
+}
+
+void TelemetryReport(const char *label, FILE *json)
+{
+  struct sample samples[SAMPLE_RING];
+  int i, j, n;
+
+  if (!telemetry.started)
+    return;
+  pthread_mutex_lock(&telemetry.lock);
+  n = telemetry.queued;
+  for (i = 0; i < n; i++)
+    samples[i] = telemetry.ring[(telemetry.head + i) % SAMPLE_RING];
+  telemetry.head = (telemetry.head + n) % SAMPLE_RING;
+  telemetry.queued = 0;
+  pthread_mutex_unlock(&telemetry.lock);
+
+  if (n) {
+    printf("%s telemetry:", label);
+    for (i = 0; i < telemetry.count; i++)
+      print_value(&telemetry.sensors[i], samples[n - 1].values[i]);
+    printf("\n");
+  }
+
+  if (!json)
+    return;
+  for (j = 0; j < n; j++) {
+    fprintf(json, "{\"report\":\"telemetry\",\"t\":%.3f", samples[j].time);
+    for (i = 0; i < telemetry.count; i++) {
+      const struct sensor *s = &telemetry.sensors[i];
+      fprintf(json, ",\"%s_%s\":%d", s->kind == SENSOR_THERMAL ? "temp_mc"
+                                                               : "freq_khz",
+              s->name, samples[j].values[i]);
+    }
+    fprintf(json, "}\n");
+  }
+  fflush(json);
+}
+
+void TelemetryReportRun(const char *label, FILE *json)
+{
+  int i;
+
+  if (!telemetry.started)
+    return;
+  pthread_mutex_lock(&telemetry.lock);
+  printf("%s telemetry min/mean/max:", label);
+  for (i = 0; i < telemetry.count; i++) {
+    const struct sensor *s = &telemetry.sensors[i];
+    double scale = 1000.0;
+    if (!s->count)
+      continue;
+    printf(" %s %.1f/%.1f/%.1f%s", s->name, s->min / scale,
+           s->sum / scale / s->count, s->max / scale,
+           s->kind == SENSOR_THERMAL ? "C" : "MHz");
+  }
+  printf("\n");
+
+  if (json) {
+    fprintf(json, "{\"report\":\"%s-telemetry\",\"dropped_samples\":%llu",
+            label, (unsigned long long) telemetry.dropped);
+    for (i = 0; i < telemetry.count; i++) {
+      const struct sensor *s = &telemetry.sensors[i];
+      if (!s->count)
+        continue;
+      fprintf(json, ",\"%s_%s\":{\"min\":%lld,\"mean\":%.1f,\"max\":%lld}",
+              s->kind == SENSOR_THERMAL ? "temp_mc" : "freq_khz", s->name,
+              (long long) s->min, (double) s->sum / s->count,
+              (long long) s->max);
+    }
+    fprintf(json, "}\n");
+    fflush(json);
+  }
+  pthread_mutex_unlock(&telemetry.lock);
+}
+
+void TelemetryStartRun(void)
+{
+  int i;
+
+  pthread_mutex_lock(&telemetry.lock);
+  for (i = 0; i < telemetry.count; i++) {
+    telemetry.sensors[i].count = 0;
+    telemetry.sensors[i].sum = 0;
+  }
+  pthread_mutex_unlock(&telemetry.lock);
+}
+
+void TelemetryStop(void)
+{
+  int i;
+
+  if (telemetry.started) {
+    pthread_mutex_lock(&telemetry.lock);
+    telemetry.stop = true;
+    pthread_cond_signal(&telemetry.stop_cond);
+    pthread_mutex_unlock(&telemetry.lock);
+    pthread_join(telemetry.thread, NULL);
+    telemetry.started = false;
+  }
+  for (i = 0; i < telemetry.count; i++)
+    close(telemetry.sensors[i].fd);
+  telemetry.count = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright © 2020 Google LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Thermal zone temperatures and cpufreq current frequencies, sampled by a
+ * background thread every period seconds and timestamped on
+ * CLOCK_MONOTONIC like the frame timings. Sensors missing from sysfs (as
+ * in containers) are skipped; returns false when there are none at all.
+ */
+bool TelemetryStart(double period);
+
+/*
+ * Print the latest reading of every sensor and write the samples taken
+ * since the previous call to json, one object per sample, unless json is
+ * NULL. Call from the thread that writes the other reports.
+ */
+void TelemetryReport(const char *label, FILE *json);
+
+/* Print min/mean/max of every sensor over the whole run */
+void TelemetryReportRun(const char *label, FILE *json);
+
+/* Drop the whole-run statistics gathered so far, e.g. during a warm-up */
+void TelemetryStartRun(void);
+
+void TelemetryStop(void);
+
+#endif